@@ -0,0 +1,297 @@
+-- File:        batch.vhd
+-- Author:      Richard James Howe
+-- Repository:  https://github.com/howerj/lfsr-vhdl
+-- Email:       howe.r.j.89@gmail.com
+-- License:     0BSD / Public Domain
+-- Description: Test bench for running many programs in one simulation
+--
+-- Each line of the manifest names an image, a file to use as input, a file
+-- containing the output expected (usually made with the C VM), the most
+-- clock cycles the test may take and optionally the configuration of the
+-- CPU it needs, for example:
+--
+--	lfsr.hex      batch.fth batch.out      100000000
+--	lfsr-next.hex batch.fth batch-next.out 100000000 next
+--
+-- An input of `-` is no input at all. Only the lines for the configuration
+-- given by the `config` generic are run, those without one being for `base`,
+-- so the manifest is run once for each configuration with the generics it
+-- needs set (see `make regression`). Lines starting with `#` are ignored.
+-- For each test the CPU is held in reset while the image is written into
+-- RAM through the loader port of `system.vhd`, then it is run with the input
+-- passed directly to it (as with `en_non_io_tb` in `tb.vhd`) until it halts
+-- or the clock limit is reached. Output and input go through the register
+-- bus too when `io_bus` is set, register 0 taking the output, register 1
+-- reading as the next byte of input with bit 8 set if there is one, and a
+-- write to it consuming the byte, like `top.vhd` without the busy flag. The
+-- interrupt line is raised while there is input. Elaboration and start up
+-- only happen once, and no waveform is written, so many more tests can be
+-- run than with `tb.vhd`. Only images in `FILE_HEX` format can be loaded.
+-- Carriage returns and trailing new lines are ignored when comparing output.
+
+library ieee, work, std;
+use ieee.std_logic_1164.all;
+use ieee.numeric_std.all;
+use work.util.all;
+use std.textio.all;
+
+entity batch is
+	generic (
+		clock_frequency: positive := 100_000_000; -- System Clock Rate (Hz)
+		manifest:        string   := "batch.txt"; -- List of tests to run
+		program:         string   := "lfsr.hex";  -- Image RAM is initialized with, before loading
+		debug:           natural  := 0;           -- Debug on (non zero = non synth)
+		N:               positive := 16;          -- Bit Width of CPU
+		config:          string   := "base";      -- Run only the tests for this configuration
+		pc_length:       positive := 8;           -- PC width, with a maximal length polynomial
+		bank_bits:       natural  := 0;
+		interrupt_enable: boolean := false;
+		next_unit:       boolean  := false;
+		io_bus:          boolean  := false;
+		lut_enable:      boolean  := false;
+		barrel_shift:    boolean  := false;
+		execute_enable:  boolean  := false;
+		link_enable:     boolean  := false
+	);
+end batch;
+
+architecture testing of batch is
+	constant g: common_generics := (
+		clock_frequency    => clock_frequency,
+		delay              => 0 ns,
+		asynchronous_reset => false
+	);
+	constant clock_period: time     := 1000 ms / g.clock_frequency;
+	constant ram_size:     positive := 2 ** (N - 4);
+
+	function maximal(bits: positive) return std_ulogic_vector is -- as `PCBITS` picks them in the C VM
+	begin
+		case bits is
+		when 9      => return x"0110";
+		when 10     => return x"0240";
+		when 11     => return x"0500";
+		when others => return x"00B8";
+		end case;
+	end function;
+
+	signal done:    boolean    := false;
+	signal clk:     std_ulogic := '0';
+	signal rst:     std_ulogic := '1';
+	signal halted, blocked: std_ulogic := 'X';
+	signal ihav, io_re, io_we, load_we: std_ulogic := '0';
+	signal ibyte, obyte: std_ulogic_vector(7 downto 0) := (others => '0');
+	signal load_addr, load_data: std_ulogic_vector(N - 1 downto 0) := (others => '0');
+	signal bus_we, bus_re: std_ulogic := '0';
+	signal bus_addr: std_ulogic_vector(3 downto 0) := (others => '0');
+	signal bus_dout, bus_din: std_ulogic_vector(N - 1 downto 0) := (others => '0');
+begin
+	uut: entity work.system
+		generic map(
+			g           => g,
+			file_name   => program,
+			N           => N,
+			pc_length   => pc_length,
+			polynomial  => maximal(pc_length),
+			debug       => debug,
+			halt_enable => true,
+			bank_bits   => bank_bits,
+			interrupt_enable => interrupt_enable,
+			next_unit   => next_unit,
+			io_bus      => io_bus,
+			lut_enable  => lut_enable,
+			barrel_shift => barrel_shift,
+			execute_enable => execute_enable,
+			link_enable => link_enable)
+		port map (
+			clk       => clk,
+			rst       => rst,
+			halted    => halted,
+			blocked   => blocked,
+			obyte     => obyte,
+			ibyte     => ibyte,
+			obsy      => '0',
+			ihav      => ihav,
+			irq       => ihav,
+			load_we   => load_we,
+			load_addr => load_addr,
+			load_data => load_data,
+			bus_addr  => bus_addr,
+			bus_dout  => bus_dout,
+			bus_din   => bus_din,
+			bus_we    => bus_we,
+			bus_re    => bus_re,
+			io_we     => io_we,
+			io_re     => io_re);
+
+	clock_process: process
+	begin
+		while not done loop
+			clk <= '1';
+			wait for clock_period / 2;
+			clk <= '0';
+			wait for clock_period / 2;
+		end loop;
+		wait;
+	end process;
+
+	run_process: process
+		file mf: text;
+		variable ml, image, input, expect, cfg, feed, got, want: line;
+		variable clocks, count, pos, passed, failed: natural := 0;
+		variable good: boolean;
+
+		procedure word(l: inout line; w: inout line) is -- next word on a line
+			variable c: character := ' ';
+			variable good: boolean := true;
+		begin
+			deallocate(w);
+			w := new string'("");
+			while good and (c = ' ' or c = HT) loop
+				read(l, c, good);
+			end loop;
+			while good and c /= ' ' and c /= HT loop
+				write(w, c);
+				read(l, c, good);
+			end loop;
+		end procedure;
+
+		procedure slurp(name: string; b: inout line) is -- whole file, each line ending in LF
+			file f: text;
+			variable fl: line;
+			variable status: file_open_status;
+		begin
+			deallocate(b);
+			b := new string'("");
+			file_open(status, f, name, read_mode);
+			assert status = open_ok report "Unable to open file: " & name severity failure;
+			while not endfile(f) loop
+				readline(f, fl);
+				for i in fl'range loop
+					if fl(i) /= CR then write(b, fl(i)); end if;
+				end loop;
+				write(b, LF);
+			end loop;
+			file_close(f);
+		end procedure;
+
+		procedure load(name: string) is -- write image to RAM, CPU held in reset
+			file f: text;
+			variable fl: line;
+			variable status: file_open_status;
+			variable slv: std_ulogic_vector(N - 1 downto 0);
+		begin
+			file_open(status, f, name, read_mode);
+			assert status = open_ok report "Unable to open image: " & name severity failure;
+			rst <= '1';
+			load_we <= '1';
+			for i in 0 to ram_size - 1 loop
+				slv := (others => '0');
+				if not endfile(f) then
+					readline(f, fl);
+					for j in 1 to (N / 4) loop
+						slv((j * 4) - 1 downto (j * 4) - 4) := hex_char_to_std_ulogic_vector_tb(fl((N / 4) - j + 1));
+					end loop;
+				end if;
+				load_addr <= std_ulogic_vector(to_unsigned(i, N));
+				load_data <= slv;
+				wait until rising_edge(clk);
+			end loop;
+			load_we <= '0';
+			wait until rising_edge(clk);
+			file_close(f);
+		end procedure;
+
+		function char(b: std_ulogic_vector) return character is
+		begin
+			return character'val(to_integer(unsigned(b(7 downto 0))));
+		end function;
+
+		function trim(s: string) return string is -- remove trailing new lines
+			variable e: integer := s'high;
+		begin
+			while e >= s'low and s(e) = LF loop
+				e := e - 1;
+			end loop;
+			return s(s'low to e);
+		end function;
+	begin
+		report "Manifest: " & manifest;
+		file_open(mf, manifest, read_mode);
+		while not endfile(mf) loop
+			readline(mf, ml);
+			word(ml, image);
+			if image'length > 0 and image(image'low) /= '#' then
+				word(ml, input);
+				word(ml, expect);
+				read(ml, clocks, good);
+				assert good report "Missing clock limit in manifest: " & image.all severity failure;
+				word(ml, cfg);
+				if cfg'length = 0 then
+					deallocate(cfg);
+					cfg := new string'("base");
+				end if;
+			end if;
+
+			if image'length > 0 and image(image'low) /= '#' and cfg.all = config then
+				load(image.all);
+				if input.all = "-" then
+					deallocate(feed);
+					feed := new string'("");
+				else
+					slurp(input.all, feed);
+				end if;
+				slurp(expect.all, want);
+				deallocate(got);
+				got := new string'("");
+
+				pos := 1;
+				count := 0;
+				rst <= '0';
+				loop
+					wait until rising_edge(clk);
+					count := count + 1;
+					if io_we = '1' and obyte /= x"0D" then
+						write(got, char(obyte));
+					end if;
+					if io_re = '1' then
+						pos := pos + 1;
+					end if;
+					if bus_we = '1' and bus_addr = x"0" and bus_dout(7 downto 0) /= x"0D" then
+						write(got, char(bus_dout));
+					end if;
+					if bus_we = '1' and bus_addr = x"1" then
+						pos := pos + 1;
+					end if;
+					if bus_re = '1' then
+						bus_din <= (others => '0');
+						if bus_addr = x"1" and pos <= feed'length then
+							bus_din(7 downto 0) <= std_ulogic_vector(to_unsigned(character'pos(feed(pos)), 8));
+							bus_din(8) <= '1';
+						end if;
+					end if;
+					if pos <= feed'length then
+						ibyte <= std_ulogic_vector(to_unsigned(character'pos(feed(pos)), ibyte'length));
+						ihav <= '1';
+					else
+						ihav <= '0';
+					end if;
+					exit when halted = '1' or count >= clocks;
+				end loop;
+				ihav <= '0';
+
+				if trim(got.all) = trim(want.all) then
+					passed := passed + 1;
+					report "PASS " & image.all & " " & expect.all & " (" & config & ") in " & integer'image(count) & " clocks";
+				else
+					failed := failed + 1;
+					report "FAIL " & image.all & " " & expect.all & " (" & config & ") after " & integer'image(count) & " clocks, got: " & got.all severity error;
+				end if;
+			end if;
+		end loop;
+		file_close(mf);
+		done <= true;
+		report "Passed " & integer'image(passed) & ", failed " & integer'image(failed);
+		assert failed = 0 report "Regression tests failed" severity failure;
+		wait;
+	end process;
+end architecture;
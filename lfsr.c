@@ -1,74 +1,1223 @@
 /* 16-bit Accumulator based VM designed using a LFSR instead of a normal
  * Program Counter, See <https://github.com/howerj/lfsr>  */
+#define _POSIX_C_SOURCE 200112L
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define SZ (0x1000)
+#define PGBITS (8) /* log2 of cells per page, pages are the unit of copy-on-write */
+#define PGSZ (1 << PGBITS)
+#define PAGES (SZ / PGSZ)
 #define POLYNOMIAL (0xB8) /* 0x84 gives period 217 instead of 255 but uses 2 taps */
 #define PCMSK (0xFF)
+#define PCMAX (11) /* widest PC, `pc_length` in `lfsr.vhd`, the operand has to hold flags too */
+#define HOSTDEV (0x7FF0) /* host services, above RAM so Forth can reach it with `!` at address $FFE0 */
+#define HFILES (16)
+#define WINDOW (0x1000) /* cells `WINDOW` to `WINDOW+SZ-1` map onto the selected bank of extended memory */
+#define BANKREG (0x7FFF) /* bank register, Forth address $FFFE */
+#define BUSBASE (0x7FE0) /* `bus_base` of `system.vhd`, the UART registers of `top.vhd` are modelled with `IOBUS` */
+#define IRQVEC (0x02) /* interrupt vector and cells the PC and accumulator are saved to, as in `lfsr.vhd` */
+#define IRQPC (0x04)
+#define IRQACC (0x08)
+#define CACHE_VERSION (1) /* change whenever the VM or the cache format changes, see `CACHE` */
+#define IPCELL (0x105) /* Forth instruction pointer, `ip_cell` in `system.vhd` */
+#define NEXTADDR (0x7FFD) /* reading here gets the cell IP points to and increments IP, with `NEXTUNIT` */
+#define LINK (0x10C) /* return address of a linking jump, `link_cell` in `lfsr.vhd` */
+#define RPCELL (0x10F) /* Forth return stack pointer, growing up from its value in the image */
+#define CALLPC (0x85) /* where NEXT calls a word, its body in `XTCELL`, and where `exit` starts */
+#define EXITPC (0xA6)
+#define XTCELL (0x107)
+#define TRACEMIN (0.0001) /* seconds, shorter waits for input or for pacing are not traced */
 
-enum { OLFSR = 1 << 0, OADD = 1 << 1, OFIRST = 1 << 2, };
+enum { OLFSR = 1 << 0, OADD = 1 << 1, OFIRST = 1 << 2, OEOF = 1 << 3, OVERIFY = 1 << 4, OHOST = 1 << 5, OIRQ = 1 << 6, OLUT = 1 << 7, OBARREL = 1 << 8, OXEQ = 1 << 9, OLINK = 1 << 10, ONEXT = 1 << 11, ORX = 1 << 12, OBUS = 1 << 13, };
+enum { HALTED, BUDGET, EXHAUSTED, }; /* reasons for `run` returning */
+
+typedef struct { /* A loaded program, read-only and shared by every VM made from it */
+	uint16_t m[SZ];
+} image_t;
+
+typedef struct { /* input served from memory */
+	const unsigned char *b;
+	size_t len, pos;
+} buf_t;
+
+typedef struct { /* modelled time, in clock cycles of the hardware, see `pace_sync` */
+	double hz, start;
+	unsigned long long clocks, frame, tx_free, rx_free;
+} pace_t;
+
+typedef struct { /* how often each cell was accessed, see `HEATMAP` */
+	uint32_t read, write, indirect, execute;
+} heat_t;
+
+typedef struct { /* worst case clocks from an entry point to the next indirect jump, see `WCET` */
+	long bound, worst, times;
+} wcet_t;
+
+typedef struct { /* Chrome trace event JSON, see `TRACE` */
+	FILE *f;
+	double start;
+	unsigned long events;
+	int limit; /* Forth words are only traced this many calls deep, up to 64 */
+	uint16_t rp0; /* return stack pointer with nothing on it */
+} trace_t;
 
 typedef struct {
-	uint16_t m[SZ], pc, a, opts;
+	uint16_t *m[PAGES], pc, a, opts, cow; /* `m` is a page table, `cow` has a bit set for each page still shared */
+	uint16_t *flat; /* the pages of `m` in one private block once `flatten` has been called, or NULL */
+	uint16_t poly, pcmsk; /* LFSR polynomial and PC mask, `POLYNOMIAL` and `PCMSK` if zero */
+	long cycles, tick, next; /* a timer interrupt is raised every `tick` instructions if not zero, the next at `next` */
+	int ie, xeq; /* interrupts unmasked, accumulator to be executed next */
+	int rx; /* byte held by the register bus UART with bit 8 set, zero if none, see `OBUS` */
+	unsigned lut; /* top operand bits of the last direct jump, XOR'd with 0x6 they are the LUT */
+	buf_t src; /* input read from here directly until it runs out, then `get` is called */
+	const struct hook *hooks; /* native routines indexed by PC, may be NULL */
+	FILE *files[HFILES]; /* opened by the guest through the host service device */
+	uint16_t *ext, bank, banks; /* extended memory, `banks` lots of `SZ` cells, may be NULL */
+	pace_t *pace; /* slow execution down to that of the hardware, may be NULL */
+	heat_t *heat; /* `SZ` access counters, may be NULL */
+	wcet_t *wcet; /* `SZ` observed clocks between indirect jumps, may be NULL */
+	long mark; /* clocks when the current entry point, `from`, was jumped to */
+	uint16_t from;
+	trace_t *trace; /* may be NULL */
+	uint64_t open; /* a bit set for each level of the return stack with a word traced as running */
+	unsigned id; /* instance number, the thread its trace events are shown in */
 	int (*get)(void *in);
+	int (*ready)(void *in); /* a byte can be had from `get` without waiting, for `ORX` */
 	int (*put)(void *out, int ch);
 	void *in, *out;
 	FILE *debug;
 } vm_t;
 
-static inline uint16_t lfsr(uint16_t n, uint16_t polynomial_mask, int add) {
-	if (add) return (n + 1) & PCMSK;
+static inline uint16_t lfsr(uint16_t n, uint16_t polynomial_mask, uint16_t pcmsk, int add) {
+	if (add) return (n + 1) & pcmsk;
 	const int feedback = n & 1;
 	n >>= 1;
-	return (feedback ? n ^ polynomial_mask : n) & PCMSK;
+	return (feedback ? n ^ polynomial_mask : n) & pcmsk;
+}
+
+static inline uint16_t logic(unsigned lut, uint16_t a, uint16_t b) { /* bit `2*a+b` of `lut` for each bit */
+	return (lut & 1 ? ~a & ~b : 0) | (lut & 2 ? ~a & b : 0) | (lut & 4 ? a & ~b : 0) | (lut & 8 ? a & b : 0);
+}
+
+static inline uint16_t shift(uint16_t a, uint16_t b, int left) { /* by `b & 15`, rotating if `b & 16` */
+	const unsigned n = b & 0xF;
+	const uint32_t x = a; /* `a << 16` would overflow an `int` when rotating by zero */
+	if (b & 0x10)
+		return left ? x << n | x >> (16 - n) : x >> n | x << (16 - n);
+	return left ? a << n : a >> n;
+}
+
+static inline uint16_t *cell(vm_t *v, uint16_t addr) {
+	addr %= SZ;
+	return &v->m[addr >> PGBITS][addr & (PGSZ - 1)];
+}
+
+static void attach(vm_t *v, image_t *img) { /* all pages start off shared with the image */
+	for (size_t i = 0; i < PAGES; i++)
+		v->m[i] = &img->m[i * PGSZ];
+	v->cow = (1u << PAGES) - 1u;
+}
+
+static void detach(vm_t *v) {
+	for (size_t i = 0; i < PAGES && !v->flat; i++)
+		if (!(v->cow & (1u << i)))
+			free(v->m[i]);
+	free(v->flat);
+	v->flat = NULL;
+	v->cow = 0;
+}
+
+static int unshare(vm_t *v, unsigned page) { /* copy-on-write, called on first write to a shared page */
+	void *p = NULL; /* page aligned so VMs on different threads never share a cache line */
+	if (posix_memalign(&p, PGSZ * sizeof (uint16_t), PGSZ * sizeof (uint16_t))) return -1;
+	memcpy(p, v->m[page], PGSZ * sizeof (uint16_t));
+	v->m[page] = p;
+	v->cow &= ~(1u << page);
+	return 0;
+}
+
+static int flatten(vm_t *v) { /* for a VM that has no use for shared pages, so `lean` can skip the page table */
+	uint16_t *f = malloc(SZ * sizeof *f);
+	if (!f) return -1;
+	for (size_t i = 0; i < PAGES; i++)
+		memcpy(&f[i * PGSZ], v->m[i], PGSZ * sizeof *f);
+	detach(v);
+	for (size_t i = 0; i < PAGES; i++)
+		v->m[i] = &f[i * PGSZ];
+	v->flat = f;
+	return 0;
+}
+
+static double seconds(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) return 0;
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Pacing runs the VM no faster than the hardware would, given its clock
+ * rate and the number of clocks each instruction takes in `lfsr.vhd`, and
+ * models the UART; `obsy` stays high while a byte is being sent and
+ * received bytes cannot arrive faster than the baud rate allows. */
+static double pace_sync(pace_t *p) { /* sleep until the wall clock catches up, returning how long for */
+	const double ahead = p->clocks / p->hz - (seconds() - p->start);
+	if (ahead <= 0) return 0;
+	struct timespec ts = { .tv_sec = (time_t)ahead, .tv_nsec = (long)((ahead - (time_t)ahead) * 1e9), };
+	(void)nanosleep(&ts, NULL);
+	return ahead;
+}
+
+static double pace_tx(pace_t *p) { /* the CPU blocks in `S_STORE` until the last byte has gone */
+	if (p->clocks < p->tx_free)
+		p->clocks = p->tx_free;
+	p->tx_free = p->clocks + p->frame;
+	return pace_sync(p);
+}
+
+static void pace_rx(pace_t *p) { /* and in `S_LOAD` until a byte arrives, for as long as the host waited too */
+	const unsigned long long now = (seconds() - p->start) * p->hz;
+	if (p->clocks < p->rx_free)
+		p->clocks = p->rx_free;
+	if (p->clocks < now)
+		p->clocks = now;
+	p->rx_free = p->clocks + p->frame;
+}
+
+/* `TRACE` writes a timeline of events in the Chrome trace event format,
+ * which can be opened with `chrome://tracing` or <https://ui.perfetto.dev>.
+ * Each VM is shown as a thread, with the Forth words it runs nested as they
+ * are called, the time it spent waiting for input or sleeping to keep pace
+ * with the hardware, the time slices it was given when there are many VMs,
+ * and how long snapshots took. Every event has the host time and how many
+ * instructions the VM had run. Events are written as they happen, so a
+ * trace is usable even if the VM is killed before it is closed. */
+static void trace_head(trace_t *t, const char *ph, unsigned id, double at) {
+	(void)fprintf(t->f, "%s{\"ph\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f",
+			t->events++ ? ",\n" : "[\n", ph, id, (at - t->start) * 1e6);
+}
+
+static void trace_span(trace_t *t, unsigned id, const char *name, double start, long instructions) { /* until now */
+	const double now = seconds();
+	trace_head(t, "X", id, start);
+	(void)fprintf(t->f, ",\"dur\":%.3f,\"name\":\"%s\",\"args\":{\"instructions\":%ld}}", (now - start) * 1e6, name, instructions);
+}
+
+static void trace_close(trace_t *t, vm_t *v, size_t n) { /* ending the words still running */
+	const double now = seconds();
+	for (size_t i = 0; i < n; i++)
+		for (; v[i].open; v[i].open &= v[i].open - 1) {
+			trace_head(t, "E", v[i].id, now);
+			(void)fprintf(t->f, ",\"args\":{\"instructions\":%ld}}", v[i].cycles);
+		}
+	(void)fputs(t->events ? "\n]\n" : "[]\n", t->f);
+}
+
+static inline int input(vm_t *v) { /* fast path avoids an indirect call per byte */
+	if (v->src.pos < v->src.len)
+		return v->src.b[v->src.pos++];
+	if (!v->trace)
+		return v->get(v->in);
+	const double start = seconds();
+	const int ch = v->get(v->in);
+	if (seconds() - start >= TRACEMIN)
+		trace_span(v->trace, v->id, "input", start, v->cycles);
+	return ch;
 }
 
-static inline uint16_t load(vm_t *v, uint16_t addr, int io) { /* more peripherals could be added if needed */
-	return io && addr & 0x8000 ? v->get(v->in) : v->m[addr % SZ];
+static inline uint16_t *far(vm_t *v, uint16_t addr) { /* for addresses beyond `SZ` */
+	if (addr == BANKREG) return &v->bank;
+	if (addr >= WINDOW && addr < WINDOW + SZ) return &v->ext[(size_t)v->bank * SZ + addr % SZ];
+	return cell(v, addr);
 }
 
-static inline void store(vm_t *v, uint16_t addr, uint16_t val, long cycles) {
+static inline int store(vm_t *v, uint16_t addr, uint16_t val, long cycles);
+
+static inline int load(vm_t *v, uint16_t addr, int io) { /* more peripherals could be added if needed */
+	if (addr >= SZ && !(addr & 0x8000)) {
+		if ((addr & 0xFFF0) == BUSBASE && v->opts & OBUS) { /* received byte, the busy flag is never set */
+			if (addr == BUSBASE + 1 && !v->rx && (v->src.pos < v->src.len || v->ready(v->in))) {
+				const int ch = input(v);
+				v->rx = ch < 0 ? 0 : 0x100 | ch;
+			}
+			return addr == BUSBASE + 1 ? v->rx : 0; /* the clock counter is not modelled */
+		}
+		if (addr == NEXTADDR && v->opts & ONEXT) { /* the IP cell is a register in `system.vhd` */
+			const uint16_t ip = *cell(v, IPCELL);
+			(void)store(v, IPCELL, ip + 1, 0);
+			return *cell(v, ip);
+		}
+		if (v->ext) return *far(v, addr);
+	}
+	return io && addr & 0x8000 ? input(v) : *cell(v, addr);
+}
+
+static int host(vm_t *v, uint16_t block);
+
+static inline int store(vm_t *v, uint16_t addr, uint16_t val, long cycles) {
+	if (addr >= SZ && v->opts & OHOST && addr == HOSTDEV)
+		return host(v, val);
+	if (addr >= SZ && (addr & 0xFFF0) == BUSBASE && v->opts & OBUS) { /* transmit, or acknowledge a byte */
+		if (addr == BUSBASE + 1)
+			v->rx = 0;
+		return addr == BUSBASE && v->put(v->out, val & 0xFF) < 0 ? -1 : 0;
+	}
+	if (addr >= SZ && v->ext && !(addr & 0x8000)) {
+		if (addr == BANKREG) {
+			v->bank = val & (v->banks - 1); /* as many bits as `bank_bits` */
+			return 0;
+		}
+		if (far(v, addr) != cell(v, addr)) {
+			*far(v, addr) = val;
+			return 0;
+		}
+	}
 	if (addr & 0x8000) {
 		if (v->opts & OFIRST) { /* Useful to know when simulating the VHDL test-bench */
 			v->opts &= ~OFIRST;
 			if (v->debug)
 				(void)fprintf(v->debug, "Cycles until first output: %ld\n", cycles);
 		}
+		if (v->pace) {
+			const double slept = pace_tx(v->pace);
+			if (v->trace && slept >= TRACEMIN)
+				trace_span(v->trace, v->id, "idle", seconds() - slept, cycles);
+		}
 		(void)v->put(v->out, val);
-	} else {
-		v->m[addr % SZ] = val;
+		return 0;
+	}
+	if (v->cow & (1u << ((addr % SZ) >> PGBITS)))
+		if (unshare(v, (addr % SZ) >> PGBITS) < 0)
+			return -1;
+	*cell(v, addr) = val;
+	return 0;
+}
+
+/* The host service device lets a guest ask for file access and the time
+ * without going through the byte stream. The guest stores the address of
+ * a request block to `HOSTDEV`, the request is carried out immediately and
+ * the result written back into the block. Addresses and lengths are in
+ * bytes, as Forth uses them, bytes are packed into cells low byte first.
+ *
+ *	Cell   | 0  | 1      | 2      | 3      | 4      | 5      | 6      |
+ *	-------+----+--------+--------+--------+--------+--------+--------+
+ *	OPEN   | 0  | handle | name   | length | mode   |        |        |
+ *	CLOSE  | 1  | 0      | handle |        |        |        |        |
+ *	READ   | 2  | count  | handle | buffer | length |        |        |
+ *	WRITE  | 3  | count  | handle | buffer | length |        |        |
+ *	SEEK   | 4  | 0      | handle | offset | offset | whence |        |
+ *	CLOCK  | 5  | 0      | seconds since the epoch           | millis |
+ *	TIMER  | 6  | 0      | microseconds, monotonic           |        |
+ *
+ * The result in cell 1 is -1 on failure. Open modes are 0 for reading, 1
+ * for writing, 2 for appending and 3 for reading and writing, an offset is
+ * split into low and high cells, SEEK leaves the new position there and
+ * whence is 0 for the start of the file, 1 the current position and 2 the
+ * end. The seconds and microseconds are 64-bit values spread over four cells.
+ * READ and WRITE move the data with one `fread` or `fwrite`, and copy it
+ * a cell at a time when the buffer starts on a cell boundary. Their buffer
+ * must lie within RAM, so it cannot reach the devices above it.
+ */
+enum { HOPEN, HCLOSE, HREAD, HWRITE, HSEEK, HCLOCK, HTIMER, };
+
+static inline uint8_t peek8(vm_t *v, uint16_t addr) {
+	return *cell(v, addr >> 1) >> (addr & 1 ? 8 : 0);
+}
+
+static inline int poke8(vm_t *v, uint16_t addr, uint8_t b) {
+	const uint16_t c = *cell(v, addr >> 1);
+	return store(v, addr >> 1, addr & 1 ? (c & 0x00FF) | (b << 8) : (c & 0xFF00) | b, 0);
+}
+
+static int host(vm_t *v, uint16_t block) {
+	const uint16_t b = block >> 1;
+	uint16_t arg[6];
+	for (int i = 0; i < 6; i++)
+		arg[i] = *cell(v, b + i);
+	const uint16_t h = arg[2];
+	FILE *f = h < HFILES ? v->files[h] : NULL;
+	const int inside = arg[3] + (unsigned long)arg[4] <= SZ * 2; /* so a count is always below the -1 of a failure */
+	long r = -1;
+	unsigned long long t = 0;
+	struct timespec ts;
+	static unsigned char buf[0x10000];
+	switch (arg[0]) {
+	case HOPEN: {
+		static const char *modes[] = { "rb", "wb", "ab", "r+b", };
+		char name[256];
+		size_t i = 0, len = arg[3] < sizeof name ? arg[3] : 0;
+		for (i = 0; i < len; i++)
+			name[i] = peek8(v, arg[2] + i);
+		name[i] = 0;
+		for (r = 0; r < HFILES && v->files[r]; r++)
+			;
+		if (!len || arg[4] > 3 || r == HFILES || !(v->files[r] = fopen(name, modes[arg[4]])))
+			r = -1;
+		break;
+	}
+	case HCLOSE:
+		if (f) { r = fclose(f) < 0 ? -1 : 0; v->files[h] = NULL; }
+		break;
+	case HREAD: {
+		size_t i = 0;
+		if (!f || !inside) break;
+		r = fread(buf, 1, arg[4], f);
+		if (!(arg[3] & 1))
+			for (; i + 1 < (size_t)r; i += 2)
+				if (store(v, (arg[3] + i) >> 1, buf[i] | (buf[i + 1] << 8), 0) < 0) return -1;
+		for (; i < (size_t)r; i++)
+			if (poke8(v, arg[3] + i, buf[i]) < 0) return -1;
+		break;
+	}
+	case HWRITE: {
+		size_t i = 0;
+		if (!f || !inside) break;
+		if (!(arg[3] & 1))
+			for (; i + 1 < arg[4]; i += 2) {
+				const uint16_t c = *cell(v, (arg[3] + i) >> 1);
+				buf[i] = c;
+				buf[i + 1] = c >> 8;
+			}
+		for (; i < arg[4]; i++)
+			buf[i] = peek8(v, arg[3] + i);
+		r = fwrite(buf, 1, arg[4], f);
+		break;
+	}
+	case HSEEK: {
+		static const int whence[] = { SEEK_SET, SEEK_CUR, SEEK_END, };
+		const long off = (long)(int32_t)(arg[3] | ((uint32_t)arg[4] << 16));
+		if (!f || arg[5] > 2 || fseek(f, off, whence[arg[5]]) < 0 || (r = ftell(f)) < 0) { r = -1; break; }
+		if (store(v, b + 3, r, 0) < 0 || store(v, b + 4, (unsigned long)r >> 16, 0) < 0) return -1;
+		r = 0;
+		break;
 	}
+	case HCLOCK:
+	case HTIMER:
+		if (clock_gettime(arg[0] == HCLOCK ? CLOCK_REALTIME : CLOCK_MONOTONIC, &ts) < 0) break;
+		t = arg[0] == HCLOCK ? (unsigned long long)ts.tv_sec : (unsigned long long)ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+		for (int i = 0; i < 4; i++)
+			if (store(v, b + 2 + i, t >> (i * 16), 0) < 0) return -1;
+		if (arg[0] == HCLOCK && store(v, b + 6, ts.tv_nsec / 1000000, 0) < 0) return -1;
+		r = 0;
+		break;
+	}
+	return store(v, b + 1, r, 0);
 }
 
-static int run(vm_t *v) {
-	uint16_t pc = v->pc, a = v->pc, *m = v->m, opts = v->opts; /* load machine state */
+/* Native hooks replace a sequence of instructions starting at a given PC
+ * with a C routine that has the same effect on memory and the accumulator,
+ * returning the PC at which the sequence would have exited. The routines
+ * are generic and take the addresses of the cells they operate on from the
+ * hook table, which is loaded alongside an image. */
+typedef struct hook {
+	int (*fn)(vm_t *v, const uint16_t *arg, uint16_t *pc, uint16_t *a);
+	uint16_t arg[4];
+	const char *name;
+} hook_t;
+
+static int run(vm_t *v, long budget);
+
+static int native_add(vm_t *v, const uint16_t *arg, uint16_t *pc, uint16_t *a) { /* x, y, carry, return */
+	uint16_t x = *cell(v, arg[0]), y = *cell(v, arg[1]), c = *cell(v, arg[2]);
+	for (; y; y = c << 1) { /* the same carry propagation loop as the kernel */
+		c = x & y;
+		x ^= y;
+	}
+	if (store(v, arg[0], x, 0) < 0 || store(v, arg[1], y, 0) < 0 || store(v, arg[2], c, 0) < 0) return -1;
+	*a = x;
+	*pc = *cell(v, arg[3]);
+	return 0;
+}
+
+static int native_lsr(vm_t *v, const uint16_t *arg, uint16_t *pc, uint16_t *a) { /* source, destination, exit */
+	*a = *cell(v, arg[0]) >> 1;
+	if (store(v, arg[1], *a, 0) < 0) return -1;
+	*pc = arg[2];
+	return 0;
+}
+
+static const hook_t natives[] = {
+	{ .fn = native_add, .name = "add", },
+	{ .fn = native_lsr, .name = "lsr", },
+};
+
+static hook_t *hooks_load(const char *name) { /* lines of "entry-pc routine arguments...", all in hex */
+	FILE *f = fopen(name, "rb");
+	hook_t *h = f ? calloc(SZ, sizeof *h) : NULL;
+	char line[256];
+	for (unsigned n = 1; h && fgets(line, sizeof line, f); n++) {
+		char fn[32] = { 0, };
+		unsigned pc = 0, arg[4] = { 0, };
+		line[strcspn(line, "#")] = 0;
+		const int r = sscanf(line, "%x %31s %x %x %x %x", &pc, fn, &arg[0], &arg[1], &arg[2], &arg[3]);
+		if (r <= 0)
+			continue;
+		size_t i = 0;
+		for (i = 0; i < sizeof (natives) / sizeof (natives[0]); i++)
+			if (!strcmp(natives[i].name, fn))
+				break;
+		if (r < 2 || pc >= SZ || i == sizeof (natives) / sizeof (natives[0])) {
+			(void)fprintf(stderr, "%s:%u: invalid hook\n", name, n);
+			free(h);
+			h = NULL;
+			break;
+		}
+		h[pc] = natives[i];
+		for (int j = 0; j < 4; j++)
+			h[pc].arg[j] = arg[j];
+	}
+	if (f && fclose(f) < 0) {
+		free(h);
+		return NULL;
+	}
+	return h;
+}
+
+/* Run both the native routine and the instructions it stands in for, from
+ * the same state, and compare the results. The state is left as the
+ * instructions left it. */
+static int verify(vm_t *v, const hook_t *h) {
+	static uint16_t before[SZ], native[SZ];
+	uint16_t pc = v->pc, a = v->a;
+	for (size_t i = 0; i < SZ; i++)
+		before[i] = *cell(v, i);
+	if (h->fn(v, h->arg, &pc, &a) < 0) return -1;
+	for (size_t i = 0; i < SZ; i++)
+		if ((native[i] = *cell(v, i)) != before[i])
+			if (store(v, i, before[i], 0) < 0) return -1;
+	const hook_t *hooks = v->hooks;
+	const uint16_t entry = v->pc;
+	long steps = 0;
+	v->hooks = NULL;
+	for (; steps < 1000000 && (!steps || v->pc != pc); steps++)
+		if (run(v, 1) != BUDGET) break;
+	v->hooks = hooks;
+	size_t diff = 0;
+	while (diff < SZ && *cell(v, diff) == native[diff])
+		diff++;
+	if (v->pc != pc || v->a != a || diff < SZ) {
+		(void)fprintf(stderr, "Hook `%s` at %d does not match after %ld instructions: pc %d/%d a %d/%d",
+				h->name, (unsigned)entry, steps, (unsigned)pc, (unsigned)v->pc, (unsigned)a, (unsigned)v->a);
+		if (diff < SZ)
+			(void)fprintf(stderr, " m[%d] %d/%d", (unsigned)diff, (unsigned)native[diff], (unsigned)*cell(v, diff));
+		(void)fputc('\n', stderr);
+		return -1;
+	}
+	return 0;
+}
+
+static void segment(vm_t *v, uint16_t to, long now) { /* `now` is the clock count after the jump */
+	wcet_t *w = &v->wcet[v->from % SZ];
+	w->worst = now - v->mark > w->worst ? now - v->mark : w->worst;
+	v->wcet[to % SZ].times++;
+	v->from = to;
+	v->mark = now;
+}
+
+static int word_name(vm_t *v, uint16_t xt, char *name) { /* looking back from the body for a header */
+	const unsigned body = (xt & 0x7FFF) * 2u; /* a link, a count byte then the name, padded to a cell */
+	for (unsigned n = 1; n < 32; n++) {
+		const unsigned h = body - ((n + 4) & ~1u);
+		if (h >= body || (peek8(v, h + 2) & 0x1F) != n || *cell(v, h >> 1) >= h) continue;
+		unsigned i = 0;
+		while (i < n && peek8(v, h + 3 + i) > ' ' && peek8(v, h + 3 + i) < 0x7F)
+			i++;
+		if (i < n) continue;
+		for (i = 0; i < n; i++)
+			name[i] = peek8(v, h + 3 + i);
+		name[n] = 0;
+		return 0;
+	}
+	return -1;
+}
+
+static void trace_word(vm_t *v, uint16_t pc, long cycles) { /* at `CALLPC` or `EXITPC` */
+	trace_t *t = v->trace;
+	const unsigned level = (uint16_t)(*cell(v, RPCELL) - t->rp0 - (pc == EXITPC)); /* what is (or was) pushed */
+	const uint64_t above = level < 64 ? ~0ull << level : 0;
+	double now = 0;
+	if (v->open & above)
+		now = seconds();
+	for (unsigned l = 63; v->open & above; l--) { /* including words left without `exit` */
+		if (!(v->open >> l & 1)) continue;
+		trace_head(t, "E", v->id, now);
+		(void)fprintf(t->f, ",\"args\":{\"instructions\":%ld}}", cycles);
+		v->open &= ~(1ull << l);
+	}
+	if (pc == EXITPC || level >= (unsigned)t->limit)
+		return;
+	char name[32];
+	trace_head(t, "B", v->id, now ? now : seconds());
+	if (word_name(v, *cell(v, XTCELL), name) < 0)
+		(void)sprintf(name, "$%x", (unsigned)*cell(v, XTCELL));
+	(void)fputs(",\"name\":\"", t->f);
+	for (char *c = name; *c; c++)
+		(void)fprintf(t->f, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+	(void)fprintf(t->f, "\",\"args\":{\"instructions\":%ld}}", cycles);
+	v->open |= 1ull << level;
+}
+
+/* `run` for the base instruction set, with nothing to count or look for.
+ * It is inlined twice by `run`, for flat memory `m` and for the page table
+ * (`m` is NULL), so neither has to check which it has on each access. */
+static inline int lean(vm_t *v, long budget, uint16_t *const m) {
+	uint16_t pc = v->pc, a = v->a; /* load machine state */
+	const uint16_t opts = v->opts, poly = v->poly ? v->poly : POLYNOMIAL, pcmsk = v->pcmsk ? v->pcmsk : PCMSK;
+	long cycles = v->cycles;
+	const long limit = cycles + budget;
+	int r = BUDGET;
+	for (;budget < 0 || cycles < limit; cycles++) {
+		const uint16_t ins = m ? m[pc % SZ] : *cell(v, pc);
+		const uint16_t imm = ins & 0xFFF;
+		const uint16_t _pc = lfsr(pc, poly, pcmsk, !!(opts & OLFSR));
+		const uint16_t arg = ins & 0x8000 ? m ? m[imm] : *cell(v, imm) : imm; /* `imm` is always below `SZ` */
+		switch ((ins >> 12) & 0x7) {
+		case 0: a ^= arg; pc = _pc; break;
+		case 1: a &= arg; pc = _pc; break;
+		case 2: a = opts & OADD ? a + arg : arg << 1; pc = _pc; break;
+		case 3: a = arg >> 1; pc = _pc; break;
+		case 4: {
+			const int ch = arg >= SZ ? load(v, arg, 1) : m ? m[arg] : *cell(v, arg);
+			if (ch < 0 && opts & OEOF) { r = EXHAUSTED; goto end; }
+			a = ch; pc = _pc; break;
+		}
+		case 5:
+			if (arg < SZ && m) /* shared pages and devices go through `store` */
+				m[arg] = a;
+			else if (arg < SZ && !(v->cow >> (arg >> PGBITS) & 1))
+				*cell(v, arg) = a;
+			else if (store(v, arg, a, cycles) < 0)
+				return -1;
+			pc = _pc; break;
+		case 6: if (pc == arg) { r = HALTED; goto end; } pc = arg; break;
+		case 7: pc = _pc; if (!a) pc = arg; break;
+		}
+	}
+end:
+	v->pc = pc; /* save machine state */
+	v->a = a;
+	v->cycles = cycles;
+	return r;
+}
+
+static int run(vm_t *v, long budget) { /* run for `budget` instructions, or forever if negative */
+	if (!v->hooks && !v->pace && !v->heat && !v->trace && !v->wcet && !v->debug && !v->xeq
+			&& !(v->opts & (OIRQ | OLUT | OBARREL | OXEQ | OLINK)))
+		return v->flat ? lean(v, budget, v->flat) : lean(v, budget, NULL); /* chosen once per call, the loop below is over twice as slow */
+	uint16_t pc = v->pc, a = v->a, opts = v->opts; /* load machine state */
+	long cycles = v->cycles;
+	const long limit = cycles + budget;
+	const hook_t *const hooks = v->hooks;
+	pace_t *const pace = v->pace;
+	heat_t *const heat = v->heat;
+	trace_t *const trace = v->trace;
+	const uint16_t poly = v->poly ? v->poly : POLYNOMIAL, pcmsk = v->pcmsk ? v->pcmsk : PCMSK;
+	unsigned lut = v->lut ^ 0x6;
+	int xeq = v->xeq;
+	/* Each instruction takes one clock for `S_FETCH`, one for `S_INDIRECT`
+	 * if indirect, and two for `S_LOAD`/`S_STORE` then `S_NEXT`. The clocks
+	 * over the instruction count are totalled in `extra` and only added to
+	 * the model when pacing needs it, on I/O and every so many jumps. */
+	long paced = cycles, extra = 0;
+#define PACE() do { pace->clocks += cycles - paced + extra; paced = cycles; extra = 0; } while (0)
+#define HEAT(addr, kind) do { if (heat && (addr) < SZ) heat[(addr)].kind++; } while (0)
+#define SEGMENT(to) do { if (v->wcet && ins & 0x8000) segment(v, (to), (pace ? (long)pace->clocks - paced : 0) + cycles + 1 + extra); } while (0)
+#define WORD(to) do { if (trace && ((to) == CALLPC || (to) == EXITPC)) trace_word(v, (to), cycles + 1); } while (0) /* only checked on jumps, which both follow */
+	int r = BUDGET;
 	static const char *names[] = { "xor", "and", "lsl1", "lsr1", "load", "store", "jmp", "jmpz", };
-	for (long cycles = 0;;cycles++) { /* An `ADD` instruction things up greatly, `OR` not so much */
-		const uint16_t ins = m[pc % SZ];
+	for (;budget < 0 || cycles < limit; cycles++) { /* An `ADD` instruction things up greatly, `OR` not so much */
+		if (hooks && !xeq && hooks[pc % SZ].fn) { /* a native routine counts as one instruction */
+			const hook_t *h = &hooks[pc % SZ];
+			if (opts & OVERIFY) {
+				v->pc = pc;
+				v->a = a;
+				v->cycles = cycles;
+				if (verify(v, h) < 0) return -1;
+				pc = v->pc;
+				a = v->a;
+				cycles = v->cycles - 1;
+				continue;
+			}
+			if (h->fn(v, h->arg, &pc, &a) < 0) return -1;
+			continue;
+		}
+		/* `S_IRQ0`, `S_IRQ1` then `S_NEXT`, the receive interrupt is only looked for every so often */
+		if (opts & OIRQ && v->ie && ((v->tick && cycles >= v->next)
+				|| (opts & ORX && !(cycles & 0xFF) && (v->src.pos < v->src.len || v->ready(v->in))))) {
+			if (v->tick && cycles >= v->next)
+				v->next = cycles + v->tick;
+			xeq = 0; /* an executed accumulator is interrupted too, it is executed again on return */
+			v->ie = 0;
+			HEAT(IRQPC, write);
+			HEAT(IRQACC, write);
+			if (store(v, IRQPC, pc, cycles) < 0 || store(v, IRQACC, a, cycles) < 0) return -1;
+			pc = IRQVEC;
+			extra += 3;
+			continue;
+		}
+		if (!xeq) HEAT(pc, execute);
+		const uint16_t ins = xeq ? a : *cell(v, pc);
+		const int executing = xeq; /* `S_EXEC`, where a jump to zero is just a jump */
+		xeq = 0;
 		const uint16_t imm = ins & 0xFFF;
+		if (ins & 0x8000) HEAT(imm, indirect);
 		const uint16_t alu = (ins >> 12) & 0x7;
-		const uint16_t _pc = lfsr(pc, POLYNOMIAL, !!(opts & OLFSR));
+		const uint16_t _pc = lfsr(pc, poly, pcmsk, !!(opts & OLFSR));
 		const uint16_t arg = ins & 0x8000 ? load(v, imm, 0) : imm;
+		extra += ins >> 15;
 		if (v->debug && fprintf(v->debug, "%d: %c a_%s %d\n", (unsigned)pc, ins & 0x8000 ? 'i' : '-', names[alu], (unsigned)a) < 0) return -1;
 		switch (alu) {
-		case 0: a ^= arg; pc = _pc; break;
+		case 0: a = opts & OLUT ? logic(lut, a, arg) : a ^ arg; pc = _pc; break;
 		case 1: a &= arg; pc = _pc; break;
-		case 2: a = opts & OADD ? a + arg : arg << 1; pc = _pc; break;
-		case 3: a = arg >> 1; pc = _pc; break;
-		case 4: a = load(v, arg, 1); pc = _pc; break;
-		case 5: store(v, arg, a, cycles); pc = _pc; break;
-		case 6: if (pc == arg) goto end; pc = arg; break; /* `goto end` for testing only */
-		case 7: pc = _pc; if (!a) pc = arg; break;
+		case 2: a = opts & OADD ? a + arg : opts & OBARREL ? shift(a, arg, 1) : arg << 1; pc = _pc; break;
+		case 3: a = opts & OBARREL ? shift(a, arg, 0) : arg >> 1; pc = _pc; break;
+		case 4: {
+			extra += 2;
+			HEAT(arg, read);
+			if (trace) v->cycles = cycles; /* for the event if `input` waits */
+			const int ch = load(v, arg, 1);
+			if (pace && arg & 0x8000) { PACE(); pace_rx(pace); }
+			if (ch < 0 && opts & OEOF) { r = EXHAUSTED; goto end; } /* Stop without retiring the instruction */
+			a = ch; pc = _pc; break;
+		}
+		case 5:
+			extra += 2;
+			if (pace && arg & 0x8000) PACE();
+			HEAT(arg, write);
+			if (store(v, arg, a, cycles) < 0) return -1;
+			pc = _pc; break;
+		case 6: {
+			if (opts & OXEQ && ins == 0x6000 && !executing) { xeq = 1; break; } /* execute `a` next, PC unchanged */
+			uint16_t to = arg;
+			if (opts & OLUT) { /* the spare operand bits of a direct jump set the LUT */
+				if (!(ins & 0x8000))
+					lut = ((ins >> 8) & 0xF) ^ 0x6;
+				to &= pcmsk;
+			}
+			if (opts & OLINK && (ins & 0x8800) == 0x0800) { /* `S_LINK` then `S_NEXT` */
+				HEAT(LINK, write);
+				if (store(v, LINK, _pc, cycles) < 0) return -1;
+				to &= pcmsk;
+				extra += 2;
+			}
+			if (opts & OIRQ && ins == (0xE000 | IRQPC)) v->ie = 1; /* return from interrupt */
+			if (pc == to) { r = HALTED; goto end; } /* `goto end` for testing only */
+			if (pace && cycles - paced > 0x1000) {
+				PACE();
+				const double slept = pace_sync(pace);
+				if (trace && slept >= TRACEMIN)
+					trace_span(trace, v->id, "idle", seconds() - slept, cycles);
+			}
+			SEGMENT(to);
+			WORD(to);
+			pc = to; break;
+		}
+		case 7: pc = _pc; if (!a) { SEGMENT(arg); pc = arg; } WORD(pc); break;
 		}
 	}
 end:
+	if (v->wcet && !pace)
+		v->mark -= extra; /* clocks are counted from zero again next time */
+	if (pace)
+		PACE();
+#undef PACE
+#undef HEAT
+#undef SEGMENT
+#undef WORD
 	v->pc = pc; /* save machine state */
 	v->a = a;
+	v->lut = lut ^ 0x6;
+	v->xeq = xeq;
+	v->cycles = cycles;
+	return r;
+}
+
+/* A pool of VMs for running many sessions at once. Only the flags and
+ * budgets the scheduler looks at are kept in arrays of their own, so VMs
+ * that are done are skipped without touching their structures. A VM that
+ * runs needs its structure anyway, so its machine state stays there. */
+typedef struct {
+	size_t n, live;
+	long *budget; /* instructions each VM may still run, negative if unlimited */
+	uint8_t *flags;
+	vm_t *vm;
+} pool_t;
+
+enum { PDONE = 1 << 0, };
+
+static void pool_free(pool_t *p) {
+	if (p->vm)
+		for (size_t i = 0; i < p->n; i++) {
+			detach(&p->vm[i]);
+			free(p->vm[i].ext);
+		}
+	free(p->budget);
+	free(p->flags);
+	free(p->vm);
+	memset(p, 0, sizeof *p);
+}
+
+static int pool_make(pool_t *p, size_t n, image_t *img, const vm_t *proto, long budget) {
+	memset(p, 0, sizeof *p);
+	p->budget = calloc(n, sizeof *p->budget);
+	p->flags = calloc(n, sizeof *p->flags);
+	p->vm = calloc(n, sizeof *p->vm);
+	p->n = n;
+	if (!p->budget || !p->flags || !p->vm) {
+		pool_free(p);
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		p->vm[i] = *proto;
+		p->vm[i].id = i;
+		p->vm[i].ext = NULL; /* each has banks of its own */
+		if (proto->ext && !(p->vm[i].ext = calloc((size_t)proto->banks * SZ, sizeof *proto->ext))) {
+			pool_free(p);
+			return -1;
+		}
+		attach(&p->vm[i], img);
+		p->budget[i] = budget;
+	}
+	p->live = n;
+	return 0;
+}
+
+static int pool_run(pool_t *p, long slice) { /* round robin until every VM is done */
+	while (p->live) {
+		for (size_t i = 0; i < p->n; i++) {
+			if (p->flags[i] & PDONE)
+				continue;
+			const long b = p->budget[i] >= 0 && p->budget[i] < slice ? p->budget[i] : slice;
+			vm_t *v = &p->vm[i];
+			const long start = v->cycles;
+			const double began = v->trace ? seconds() : 0;
+			const int r = run(v, b);
+			if (r < 0) return -1;
+			if (v->trace)
+				trace_span(v->trace, v->id, "slice", began, v->cycles);
+			if (p->budget[i] >= 0)
+				p->budget[i] -= v->cycles - start;
+			if (r != BUDGET || !p->budget[i]) {
+				p->flags[i] |= PDONE;
+				p->live--;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Snapshots only hold the cells that differ from the image a VM was made
+ * from, as runs of changed cells each preceded by the number of unchanged
+ * cells skipped over and the length of the run. Pages that are still shared
+ * with the image cannot differ so are not even looked at. */
+typedef struct {
+	uint16_t pc, a, *d;
+	long cycles;
+	size_t len, sz;
+} snap_t;
+
+static int snap_grow(snap_t *s, size_t need) {
+	if (s->len + need <= s->sz) return 0;
+	size_t sz = s->sz ? s->sz : 64;
+	while (sz < s->len + need) sz *= 2;
+	uint16_t *d = realloc(s->d, sz * sizeof *d);
+	if (!d) return -1;
+	s->d = d;
+	s->sz = sz;
+	return 0;
+}
+
+static int snap_take(vm_t *v, const image_t *base, snap_t *s) {
+	size_t last = 0;
+	s->len = 0;
+	s->pc = v->pc;
+	s->a = v->a;
+	s->cycles = v->cycles;
+	for (size_t i = 0; i < SZ;) {
+		if (v->cow & (1u << (i >> PGBITS))) { i += PGSZ; continue; }
+		if (*cell(v, i) == base->m[i]) { i++; continue; }
+		size_t j = i;
+		while (j < SZ && !(v->cow & (1u << (j >> PGBITS))) && *cell(v, j) != base->m[j])
+			j++;
+		if (snap_grow(s, 2 + j - i) < 0) return -1;
+		s->d[s->len++] = i - last;
+		s->d[s->len++] = j - i;
+		for (; i < j; i++)
+			s->d[s->len++] = *cell(v, i);
+		last = j;
+	}
+	return 0;
+}
+
+static int snap_restore(vm_t *v, image_t *base, const snap_t *s) {
+	detach(v);
+	attach(v, base);
+	for (size_t i = 0, at = 0; i + 1 < s->len;) {
+		at += s->d[i];
+		const size_t n = s->d[i + 1];
+		i += 2;
+		if (at + n > SZ || i + n > s->len) return -1;
+		for (size_t j = 0; j < n; j++)
+			if (store(v, at++, s->d[i++], 0) < 0) return -1;
+	}
+	v->pc = s->pc;
+	v->a = s->a;
+	v->cycles = s->cycles;
+	return 0;
+}
+
+static int put16(FILE *f, uint16_t w) {
+	return fputc(w & 0xFF, f) < 0 || fputc(w >> 8, f) < 0 ? -1 : 0;
+}
+
+static int get16(FILE *f, uint16_t *w) {
+	const int lo = fgetc(f), hi = fgetc(f);
+	if (lo < 0 || hi < 0) return -1;
+	*w = lo | (hi << 8);
+	return 0;
+}
+
+/* A file of snapshots is a sequence of records of little endian 16-bit
+ * words; a magic number, PC, accumulator, cycle count (four words), the
+ * number of words of data to follow, and the data itself. */
+enum { SNAP_MAGIC = 0x534C, };
+
+static int snap_write(FILE *f, const snap_t *s) {
+	int r = put16(f, SNAP_MAGIC) | put16(f, s->pc) | put16(f, s->a);
+	for (int i = 0; i < 4; i++)
+		r |= put16(f, (uint16_t)((unsigned long long)s->cycles >> (i * 16)));
+	r |= put16(f, s->len & 0xFFFF) | put16(f, s->len >> 16);
+	for (size_t i = 0; i < s->len; i++)
+		r |= put16(f, s->d[i]);
+	return r < 0 || fflush(f) < 0 ? -1 : 0;
+}
+
+static int snap_read(FILE *f, snap_t *s) { /* returns 1 at end of file */
+	uint16_t magic = 0, w[8];
+	if (get16(f, &magic) < 0) return 1;
+	if (magic != SNAP_MAGIC) return -1;
+	for (int i = 0; i < 8; i++)
+		if (get16(f, &w[i]) < 0) return -1;
+	s->pc = w[0];
+	s->a = w[1];
+	s->cycles = (long)((unsigned long long)w[2] | (unsigned long long)w[3] << 16 | (unsigned long long)w[4] << 32 | (unsigned long long)w[5] << 48);
+	s->len = 0;
+	const size_t len = w[6] | (size_t)w[7] << 16;
+	if (snap_grow(s, len) < 0) return -1;
+	for (s->len = 0; s->len < len; s->len++)
+		if (get16(f, &s->d[s->len]) < 0) return -1;
+	return 0;
+}
+
+static int snap_load(const char *name, long rewind, snap_t *s) { /* get the snapshot `rewind` from the last */
+	FILE *f = fopen(name, "rb");
+	struct stat st;
+	long *at = NULL, count = 0, sz = 0, pos = 0;
+	int r = f && fstat(fileno(f), &st) == 0 ? 0 : -1;
+	while (r == 0 && pos < st.st_size) { /* only the headers are read, to find where each one starts */
+		uint16_t magic = 0, w[8] = { 0, };
+		r = get16(f, &magic) < 0 || magic != SNAP_MAGIC ? -1 : 0;
+		for (int i = 0; i < 8 && r == 0; i++)
+			r = get16(f, &w[i]);
+		const long next = pos + 18 + 2 * (long)(w[6] | (unsigned long)w[7] << 16);
+		if (r < 0 || next > st.st_size || fseek(f, next, SEEK_SET) < 0) { r = -1; break; }
+		if (count == sz) {
+			long *n = realloc(at, (sz = sz ? sz * 2 : 64) * sizeof *n);
+			if (!n) { r = -1; break; }
+			at = n;
+		}
+		at[count++] = pos;
+		pos = next;
+	}
+	if (r == 0 && (rewind < 0 || rewind >= count || fseek(f, at[count - 1 - rewind], SEEK_SET) < 0 || snap_read(f, s)))
+		r = -1;
+	free(at);
+	if (f && fclose(f) < 0)
+		r = -1;
+	return r;
+}
+
+/* A heatmap file is the magic number then, for every cell that was accessed
+ * at all, the cell address and its read, write, indirect operand and execute
+ * counts as 32-bit numbers (each two words, low word first), all little
+ * endian 16-bit words like snapshots. Reads and writes are only those made by
+ * `load` and `store` instructions (and interrupts and linking jumps), not
+ * those by native routines or the host service device. */
+enum { HEAT_MAGIC = 0x4D48, };
+
+static int heat_write(FILE *f, const heat_t *h) {
+	int r = put16(f, HEAT_MAGIC);
+	for (size_t i = 0; i < SZ; i++) {
+		const uint32_t c[] = { h[i].read, h[i].write, h[i].indirect, h[i].execute, };
+		if (!(c[0] | c[1] | c[2] | c[3])) continue;
+		r |= put16(f, i);
+		for (int j = 0; j < 4; j++)
+			r |= put16(f, c[j] & 0xFFFF) | put16(f, c[j] >> 16);
+	}
+	return r;
+}
+
+static int heat_read(FILE *f, heat_t *h) {
+	uint16_t w[9];
+	if (get16(f, &w[0]) < 0 || w[0] != HEAT_MAGIC) return -1;
+	memset(h, 0, SZ * sizeof *h);
+	while (get16(f, &w[0]) == 0) {
+		for (int j = 1; j < 9; j++)
+			if (get16(f, &w[j]) < 0) return -1;
+		if (w[0] >= SZ) return -1;
+		h[w[0]] = (heat_t) {
+			.read     = w[1] | (uint32_t)w[2] << 16, .write   = w[3] | (uint32_t)w[4] << 16,
+			.indirect = w[5] | (uint32_t)w[6] << 16, .execute = w[7] | (uint32_t)w[8] << 16, };
+	}
 	return 0;
 }
 
+/* Every cell can be used directly as an operand, so moving variables about
+ * cannot save any indirection. What can be saved is an indirect operand
+ * that only ever points at the same place; if a profile shows the cell it
+ * names was never written, and it holds an address or value that fits in
+ * an operand, the instruction can use that directly and skip `S_INDIRECT`.
+ * Only instructions that were executed and never read or written as data
+ * are changed. A profile only shows what one run did, so the rewritten
+ * image should be checked with the programs it is meant for. Jumps are
+ * left alone when the direct form means something else (see `run`). */
+static long optimise(image_t *img, const heat_t *h, uint16_t opts, long *saved) {
+	long n = 0;
+	*saved = 0;
+	for (size_t p = 0; p < SZ; p++) {
+		const uint16_t ins = img->m[p], x = ins & 0xFFF, alu = (ins >> 12) & 0x7;
+		if (!(ins & 0x8000) || !h[p].execute || h[p].read || h[p].write || h[x].write) continue;
+		if (img->m[x] >= 0x1000) continue;
+		if (alu == 6 && opts & (OLUT | OXEQ | OLINK | OIRQ)) continue;
+		img->m[p] = (alu << 12) | img->m[x];
+		*saved += h[p].execute;
+		n++;
+	}
+	return n;
+}
+
+static int heat_show(FILE *f, const heat_t *h) { /* 64 cells a row, darker for more accesses on a log scale */
+	static const char shade[] = " .:-=+*#%@";
+	uint64_t max = 0, total[SZ];
+	for (size_t i = 0; i < SZ; i++) {
+		total[i] = (uint64_t)h[i].read + h[i].write + h[i].indirect + h[i].execute;
+		max = total[i] > max ? total[i] : max;
+	}
+	int bits = 0;
+	while (max >> bits) bits++;
+	if (fprintf(f, "Heatmap, ' ' none to '@' %llu accesses\n", (unsigned long long)max) < 0) return -1;
+	for (size_t i = 0; i < SZ; i += 64) {
+		char row[65] = { 0, };
+		for (size_t j = 0; j < 64; j++) {
+			int b = 0;
+			while (total[i + j] >> b) b++;
+			row[j] = shade[total[i + j] ? 1 + (b - 1) * 8 / (bits > 1 ? bits - 1 : 1) : 0];
+		}
+		if (fprintf(f, "%03x: %s\n", (unsigned)i, row) < 0) return -1;
+	}
+	for (int n = 0; n < 16; n++) { /* hottest cells */
+		size_t at = 0;
+		for (size_t i = 1; i < SZ; i++)
+			at = total[i] > total[at] ? i : at;
+		if (!total[at]) break;
+		if (fprintf(f, "%03x: read %lu, write %lu, indirect %lu, execute %lu\n", (unsigned)at,
+				(unsigned long)h[at].read, (unsigned long)h[at].write,
+				(unsigned long)h[at].indirect, (unsigned long)h[at].execute) < 0) return -1;
+		total[at] = 0;
+	}
+	return 0;
+}
+
+/* Static worst case execution time analysis. From an entry point every path
+ * is followed to the indirect jump (or halt) that ends it, adding up the
+ * clocks each instruction takes in `lfsr.vhd`, as `run` counts them. Values
+ * are tracked as which of their bits are known, so a conditional jump is
+ * only followed both ways if the accumulator might or might not be zero,
+ * and a loop that shifts a value until it is zero, such as the adder, is
+ * unrolled until it has to exit. The cells tracked are those named by the
+ * direct stores in the code; any other cell that was not written during the
+ * run is taken to hold its value in the image, and a store through a pointer
+ * that is not known forgets all tracked values. A loop that gets no closer to
+ * exiting makes the bound infinite. Time waiting on I/O is not counted. The
+ * longest path from every state reached is kept in a hash table. */
+enum { WTRACK = 32, WSTATES = 1 << 16, WEMPTY = -4, WFULL = -3, WBUSY = -2, WLOOP = -1, };
+
+typedef struct { /* known bits, and their values */
+	uint16_t k, v;
+} bits_t;
+
+typedef struct {
+	uint16_t pc;
+	bits_t a, c[WTRACK];
+} wstate_t;
+
+typedef struct {
+	const image_t *img;
+	const heat_t *heat;
+	uint16_t track[WTRACK], tracked, poly, pcmsk, opts;
+	wstate_t *key;
+	long *cost;
+	size_t used;
+} wctx_t;
+
+static bits_t wcell(const wctx_t *w, const wstate_t *s, bits_t addr) {
+	const bits_t unknown = { 0, 0, };
+	if (addr.k != 0xFFFF || addr.v & 0x8000) return unknown;
+	for (size_t i = 0; i < w->tracked; i++)
+		if (w->track[i] == addr.v % SZ) return s->c[i];
+	if (addr.v >= SZ || w->heat[addr.v].write) return unknown;
+	return (bits_t) { 0xFFFF, w->img->m[addr.v], };
+}
+
+static void wstore(const wctx_t *w, wstate_t *s, bits_t addr, bits_t val) {
+	if (addr.k & 0x8000 && addr.v & 0x8000) return; /* output */
+	for (size_t i = 0; i < w->tracked; i++)
+		if (addr.k != 0xFFFF || w->track[i] == addr.v % SZ)
+			s->c[i] = addr.k == 0xFFFF ? val : (bits_t) { 0, 0, };
+}
+
+static long wwalk(wctx_t *w, const wstate_t *s) { /* clocks of the longest path from `s`, or < 0 */
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < sizeof *s; i++)
+		hash = (hash ^ ((const unsigned char *)s)[i]) * 16777619u;
+	size_t h = hash % WSTATES;
+	for (; w->cost[h] != WEMPTY; h = (h + 1) % WSTATES)
+		if (!memcmp(&w->key[h], s, sizeof *s))
+			return w->cost[h] == WBUSY ? WLOOP : w->cost[h];
+	if (w->used >= WSTATES / 2) return WFULL;
+	w->used++;
+	w->key[h] = *s;
+	w->cost[h] = WBUSY;
+
+	const uint16_t ins = w->img->m[s->pc % SZ], imm = ins & 0xFFF, alu = (ins >> 12) & 0x7;
+	const bits_t arg = ins & 0x8000 ? wcell(w, s, (bits_t) { 0xFFFF, imm, }) : (bits_t) { 0xFFFF, imm, }, a = s->a;
+	const long clocks = 1 + (ins >> 15) + (alu == 4 || alu == 5) * 2;
+	wstate_t next[2] = { *s, *s, };
+	int n = 1;
+	next[0].pc = lfsr(s->pc, w->poly, w->pcmsk, !!(w->opts & OLFSR));
+	switch (alu) {
+	case 0: next[0].a = (bits_t) { a.k & arg.k, (a.v ^ arg.v) & a.k & arg.k, }; break;
+	case 1: {
+		const uint16_t k = (a.k & arg.k) | (a.k & ~a.v) | (arg.k & ~arg.v);
+		next[0].a = (bits_t) { k, a.v & arg.v & k, };
+		break;
+	}
+	case 2:
+		if (w->opts & OADD)
+			next[0].a = a.k == 0xFFFF && arg.k == 0xFFFF ? (bits_t) { 0xFFFF, a.v + arg.v, } : (bits_t) { 0, 0, };
+		else
+			next[0].a = (bits_t) { (arg.k << 1) | 1, arg.v << 1, };
+		break;
+	case 3: next[0].a = (bits_t) { (arg.k >> 1) | 0x8000, arg.v >> 1, }; break;
+	case 4: next[0].a = wcell(w, s, arg); break;
+	case 5: wstore(w, &next[0], arg, a); break;
+	case 6:
+		if (ins & 0x8000) n = 0;
+		else if (imm == s->pc) n = 0; /* halt */
+		else next[0].pc = imm;
+		break;
+	case 7:
+		if (a.k & a.v) break; /* cannot be zero */
+		if (ins & 0x8000) { /* if taken the jump ends the path */
+			n = a.k != 0xFFFF;
+			break;
+		}
+		next[1].pc = imm;
+		n = 2;
+		if (a.k == 0xFFFF) /* must be zero */
+			next[0] = next[1], n = 1;
+		break;
+	}
+	long worst = 0;
+	for (int i = 0; i < n && worst >= 0; i++) {
+		const long r = wwalk(w, &next[i]);
+		worst = r < 0 ? r : r > worst ? r : worst;
+	}
+	w->cost[h] = worst < 0 ? worst : clocks + worst;
+	return w->cost[h];
+}
+
+static long wcet(wctx_t *w, uint16_t entry) {
+	wstate_t s;
+	memset(&s, 0, sizeof s);
+	s.pc = entry;
+	for (size_t i = 0; i < WSTATES; i++)
+		w->cost[i] = WEMPTY;
+	w->used = 0;
+	return wwalk(w, &s);
+}
+
+/* Entry points are found in the image as well as taken from the run, so
+ * code the run did not reach is bounded too: reset, code that can only be
+ * reached by an indirect jump (it follows a jump and no direct jump goes to
+ * it), return addresses loaded from constants into a cell that is jumped
+ * through, and primitives in the dictionary, whose code field holds their
+ * PC followed by `exit` (a literal followed by `exit` looks the same, so a
+ * few places that are not entry points are bounded too). Primitives only
+ * used within other words, that the run did not reach, can be missed. */
+static void wcet_entries(const wctx_t *w, uint8_t *entry) {
+	const uint16_t *m = w->img->m;
+	static uint8_t direct[SZ], through[SZ];
+	memset(direct, 0, sizeof direct);
+	memset(through, 0, sizeof through);
+	for (size_t p = 0; p <= w->pcmsk; p++)
+		if ((m[p] >> 13 & 0x3) == 0x3) /* `jmp` or `jmpz` */
+			(m[p] & 0x8000 ? through : direct)[m[p] & 0xFFF] = 1;
+	entry[0] = 1;
+	for (size_t p = 0; p <= w->pcmsk; p++) {
+		const uint16_t n = lfsr(p, w->poly, w->pcmsk, !!(w->opts & OLFSR)), k = m[p] & 0xFFF;
+		if ((m[p] & 0x7000) == 0x6000 && m[n] && !direct[n])
+			entry[n] = 1;
+		if ((m[p] & 0xF000) == 0x4000 && (m[n] & 0xF000) == 0x5000 && through[m[n] & 0xFFF] && m[k] <= w->pcmsk)
+			entry[m[k]] = 1;
+	}
+	for (size_t i = w->pcmsk + 1; i < SZ - 1; i++)
+		if (m[i] && m[i] <= w->pcmsk && m[i + 1] == EXITPC)
+			entry[m[i]] = 1;
+}
+
+static int wcet_show(FILE *f, const vm_t *v, const image_t *img) { /* check bounds against what `run` saw */
+	static wstate_t key[WSTATES];
+	static long cost[WSTATES];
+	wctx_t w = { .img = img, .heat = v->heat, .key = key, .cost = cost, .opts = v->opts,
+		.poly = v->poly ? v->poly : POLYNOMIAL, .pcmsk = v->pcmsk ? v->pcmsk : PCMSK, };
+	for (size_t p = 0; p <= w.pcmsk; p++) { /* cells named by direct stores in the code */
+		const uint16_t ins = img->m[p], c = ins & 0xFFF;
+		if ((ins & 0xF000) != 0x5000) continue;
+		size_t i = 0;
+		while (i < w.tracked && w.track[i] != c) i++;
+		if (i < w.tracked) continue;
+		if (w.tracked == WTRACK) return -1;
+		w.track[w.tracked++] = c;
+	}
+	static uint8_t entry[SZ];
+	memset(entry, 0, sizeof entry);
+	wcet_entries(&w, entry);
+	long entries = 0, bounded = 0, exceeded = 0, found = 0;
+	for (size_t p = 0; p < SZ; p++) {
+		const wcet_t *o = &v->wcet[p];
+		if (!o->times && !entry[p]) continue;
+		found += entry[p];
+		const long bound = wcet(&w, p);
+		entries++;
+		bounded += bound >= 0;
+		exceeded += bound >= 0 && o->worst > bound;
+		char b[32];
+		(void)snprintf(b, sizeof b, "%ld", bound);
+		if (fprintf(f, "%03x: bound %s, observed %ld, entered %ld%s\n", (unsigned)p,
+				bound == WLOOP ? "loop" : bound == WFULL ? "unknown" : b, o->worst, o->times,
+				bound >= 0 && o->worst > bound ? " EXCEEDED" : "") < 0) return -1;
+	}
+	return fprintf(f, "Entries %ld (%ld found in the image), bounded %ld, exceeded %ld\n", entries, found, bounded, exceeded) < 0 ? -1 : 0;
+}
+
 static int put(void *out, int ch) { 
 	ch = fputc(ch, (FILE*)out); 
 	return fflush((FILE*)out) < 0 ? -1 : ch; 
@@ -78,29 +1227,557 @@ static int get(void *in) {
 	return fgetc((FILE*)in); 
 }
 
+static int ready(void *in) { /* for `get`, `in` is unbuffered so `poll` sees all there is */
+	FILE *f = in;
+	struct pollfd p = { .fd = fileno(f), .events = POLLIN, };
+	if (feof(f) || poll(&p, 1, 0) <= 0) return 0;
+	const int ch = fgetc(f); /* readable could mean the end of input */
+	return ch != EOF && ungetc(ch, f) != EOF;
+}
+
+static int discard(void *out, int ch) {
+	(void)out;
+	return ch;
+}
+
+static int get_buf(void *in) {
+	buf_t *b = in;
+	return b->pos < b->len ? b->b[b->pos++] : -1;
+}
+
+static int ready_buf(void *in) {
+	const buf_t *b = in;
+	return b->pos < b->len;
+}
+
+static unsigned char *slurp(FILE *in, size_t *len) {
+	size_t sz = 0, n = 0;
+	unsigned char *b = NULL;
+	for (;;) {
+		if (n == sz) {
+			unsigned char *nb = realloc(b, (sz = sz ? sz * 2 : 4096));
+			if (!nb) { free(b); return NULL; }
+			b = nb;
+		}
+		const size_t rd = fread(b + n, 1, sz - n, in);
+		n += rd;
+		if (rd == 0) break;
+	}
+	if (ferror(in)) { free(b); return NULL; }
+	*len = n;
+	return b;
+}
+
+typedef struct { /* Forth source files fed to the VM before `stdin` */
+	vm_t *v;
+	char **files;
+	int count, at, mapped;
+	void *map;
+	size_t bytes;
+	double start;
+	FILE *stats;
+	int hold; /* return EOF once when the files run out, so the VM can be saved */
+} feed_t;
+
+static int unmap(feed_t *f) {
+	const int r = f->map ? munmap(f->map, f->v->src.len) : 0;
+	f->map = NULL;
+	f->v->src = (buf_t) { .b = NULL, };
+	return r;
+}
+
+static int get_feed(void *in) { /* only called each time a file runs out, bytes come from `v->src` */
+	feed_t *f = in;
+	if (!f->at)
+		f->start = seconds();
+	if (unmap(f) < 0) return -1;
+	while (f->at < f->count) {
+		const char *name = f->files[f->at++];
+		struct stat st;
+		const int fd = open(name, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			(void)fprintf(stderr, "Unable to open file `%s` for reading\n", name);
+			if (fd >= 0) (void)close(fd);
+			continue;
+		}
+		void *m = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		(void)close(fd);
+		if (m == MAP_FAILED)
+			continue;
+		f->map = m;
+		f->bytes += st.st_size;
+		f->mapped++;
+		f->v->src = (buf_t) { .b = m, .len = st.st_size, .pos = 1, };
+		return f->v->src.b[0];
+	}
+	if (f->stats && f->count >= 0) {
+		const double took = seconds() - f->start;
+		(void)fprintf(f->stats, "Loaded %lu bytes from %d file(s) in %g seconds, %g bytes/second\n",
+				(unsigned long)f->bytes, f->mapped, took, took > 0 ? f->bytes / took : 0);
+		f->count = -1;
+	}
+	if (f->hold) {
+		f->hold = 0;
+		return -1;
+	}
+	return fgetc(stdin);
+}
+
+static int ready_feed(void *in) { /* the files are read from `v->src` once opened */
+	const feed_t *f = in;
+	return f->at < f->count || ready(stdin);
+}
+
+static int binary(const char *name) { /* `single_port_block_ram` can also read lines of binary digits */
+	const size_t l = strlen(name);
+	return l > 4 && !strcmp(&name[l - 4], ".bin");
+}
+
+static int image_load(image_t *img, const char *name) {
+	FILE *prog = fopen(name, "rb");
+	if (!prog) return -1;
+	for (size_t i = 0; i < SZ; i++) {
+		unsigned long d = 0;
+		char bits[17] = { 0, };
+		if (binary(name)) {
+			if (fscanf(prog, " %16[01]", bits) != 1)
+				break;
+			d = strtoul(bits, NULL, 2);
+		} else if (fscanf(prog, "%lx,", &d) != 1) { /* optional comma */
+			break;
+		}
+		img->m[i] = d;
+	}
+	return fclose(prog);
+}
+
+/* Save the memory of a VM as an image which starts executing at `pc`, the
+ * first cell is the reset vector and is replaced with a jump to it. */
+static int image_save(vm_t *v, const char *name, uint16_t pc) {
+	FILE *out = fopen(name, "wb");
+	if (!out) return -1;
+	int r = 0;
+	for (size_t i = 0; i < SZ && r >= 0; i++) {
+		const uint16_t d = i ? *cell(v, i) : 0x6000u | pc;
+		if (binary(name)) {
+			for (int j = 15; j >= 0 && r >= 0; j--)
+				r = fputc('0' + ((d >> j) & 1), out);
+			r = r < 0 ? r : fputc('\n', out);
+		} else {
+			r = fprintf(out, "%04X\n", (unsigned)d);
+		}
+	}
+	return fclose(out) < 0 || r < 0 ? -1 : 0;
+}
+
+/* Booting and loading the same source files is repeated every time the VM
+ * starts, so with `CACHE` the state once the files have been read is kept
+ * in a directory, in a file named after a hash of everything that state
+ * depends on; the image, the contents of the files, the options that change
+ * what instructions do and `CACHE_VERSION`. The file holds the magic number,
+ * version, hash (four words) and the length of the output (two words), as
+ * little endian 16-bit words, then the output as bytes so it can be shown
+ * again, then a snapshot. Anything that does not match is rebuilt. */
+enum { CACHE_MAGIC = 0x434C, };
+
+typedef struct { /* output kept while warming up, so a cache hit can repeat it */
+	int (*put)(void *out, int ch);
+	void *out;
+	unsigned char *b;
+	size_t len, sz;
+} tee_t;
+
+static int put_tee(void *out, int ch) {
+	tee_t *t = out;
+	if (t->len == t->sz) {
+		const size_t sz = t->sz ? t->sz * 2 : 256;
+		unsigned char *b = realloc(t->b, sz);
+		if (!b) return -1;
+		t->b = b;
+		t->sz = sz;
+	}
+	t->b[t->len++] = ch;
+	return t->put(t->out, ch);
+}
+
+static uint64_t fnv(uint64_t h, const void *p, size_t len) {
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ ((const unsigned char *)p)[i]) * 1099511628211ull;
+	return h;
+}
+
+static uint64_t cache_key(const image_t *img, const vm_t *v, char **files, int count) {
+	const uint16_t head[] = { CACHE_VERSION, v->opts & (OLFSR | OADD | OBARREL | OXEQ | OLINK | ONEXT), v->poly, v->pcmsk, };
+	uint64_t h = fnv(14695981039346656037ull, head, sizeof head);
+	h = fnv(h, img->m, sizeof img->m);
+	for (int i = 0; i < count; i++) {
+		FILE *f = fopen(files[i], "rb");
+		unsigned char b[4096];
+		size_t n = 0, total = 0;
+		while (f && (n = fread(b, 1, sizeof b, f)) > 0)
+			h = fnv(h, b, n), total += n;
+		h = fnv(h, &total, sizeof total); /* file boundaries matter, missing files are empty */
+		if (f) (void)fclose(f);
+	}
+	return h;
+}
+
+static int cache_load(const char *name, uint64_t key, snap_t *s, tee_t *t) {
+	FILE *f = fopen(name, "rb");
+	if (!f) return -1;
+	uint16_t w[8];
+	int r = 0;
+	for (int i = 0; i < 8 && r >= 0; i++)
+		r = get16(f, &w[i]);
+	if (r < 0 || w[0] != CACHE_MAGIC || w[1] != CACHE_VERSION) goto fail;
+	for (int i = 0; i < 4; i++)
+		if (w[2 + i] != (uint16_t)(key >> (i * 16))) goto fail;
+	t->len = t->sz = w[6] | (size_t)w[7] << 16;
+	if (t->len && (!(t->b = malloc(t->len)) || fread(t->b, 1, t->len, f) != t->len)) goto fail;
+	if (snap_read(f, s)) goto fail;
+	return fclose(f);
+fail:
+	(void)fclose(f);
+	free(t->b);
+	*t = (tee_t) { .b = NULL, };
+	return -1;
+}
+
+static int cache_save(const char *name, uint64_t key, vm_t *v, const image_t *img, snap_t *s, const tee_t *t) {
+	char tmp[4096];
+	if (snprintf(tmp, sizeof tmp, "%s.%ld", name, (long)getpid()) >= (int)sizeof tmp) return -1;
+	FILE *f = fopen(tmp, "wb"); /* renamed into place, so other processes never see half a file */
+	if (!f) return -1;
+	int r = put16(f, CACHE_MAGIC) | put16(f, CACHE_VERSION);
+	for (int i = 0; i < 4; i++)
+		r |= put16(f, key >> (i * 16));
+	r |= put16(f, t->len & 0xFFFF) | put16(f, t->len >> 16);
+	if (t->len && fwrite(t->b, 1, t->len, f) != t->len) r = -1;
+	if (r < 0 || snap_take(v, img, s) < 0 || snap_write(f, s) < 0) r = -1;
+	if (fclose(f) < 0) r = -1;
+	if (r < 0 || rename(tmp, name) < 0) {
+		(void)remove(tmp);
+		return -1;
+	}
+	return 0;
+}
+
 static int option(const char *opt) { /* very lazy options */
 	char *r = getenv(opt);
 	if (!r) return 0; /* Never indicate failure, never show weakness in option processing */
 	return atoi(r); /* We could do case insensitive check for "yes"/"on" = 1, and "no"/"off" = 0 as well */
 }
 
+static int pool_main(vm_t *proto, image_t *image, char **files, int count, long instances) {
+	/* Every instance replays the same input, the source files then `stdin`,
+	 * and only the first one's output is shown */
+	size_t len = 0;
+	unsigned char *in = NULL;
+	for (int i = 0; i <= count; i++) {
+		FILE *f = i < count ? fopen(files[i], "rb") : stdin;
+		size_t n = 0;
+		unsigned char *b = f ? slurp(f, &n) : NULL, *nb = b ? realloc(in, len + n + 1) : NULL;
+		if (f && f != stdin) (void)fclose(f);
+		if (!nb) {
+			(void)fprintf(stderr, "Unable to read `%s`\n", i < count ? files[i] : "stdin");
+			free(b);
+			free(in);
+			return -1;
+		}
+		memcpy(nb + len, b, n);
+		in = nb;
+		len += n;
+		free(b);
+	}
+	buf_t *bufs = calloc(instances, sizeof *bufs);
+	pool_t pool;
+	proto->opts |= OEOF;
+	proto->get = get_buf;
+	proto->ready = ready_buf;
+	if (!bufs || pool_make(&pool, instances, image, proto, option("LIMIT") > 0 ? option("LIMIT") : -1) < 0) {
+		(void)fprintf(stderr, "Out of memory\n");
+		free(in);
+		free(bufs);
+		return -1;
+	}
+	for (long i = 0; i < instances; i++) {
+		bufs[i] = (buf_t) { .b = in, .len = len, };
+		pool.vm[i].in = &bufs[i];
+		if (i) pool.vm[i].put = discard;
+	}
+	const double start = seconds();
+	int r = pool_run(&pool, option("SLICE") > 0 ? option("SLICE") : 10000);
+	const double took = seconds() - start;
+	if (option("STATS")) {
+		long total = 0;
+		for (long i = 0; i < instances; i++)
+			total += pool.vm[i].cycles;
+		(void)fprintf(stderr, "Instances %ld, instructions %ld, seconds %g, instructions/second %g\n",
+				instances, total, took, took > 0 ? total / took : 0);
+	}
+	if (proto->trace)
+		trace_close(proto->trace, pool.vm, pool.n);
+	pool_free(&pool);
+	free(bufs);
+	free(in);
+	return r;
+}
+
 int main(int argc, char **argv) {
-	vm_t vm = { .pc = 0, .put = put, .get = get, .in = stdin, .out = stdout, .debug = option("DEBUG") ? stderr : NULL, };
+	static image_t image;
+	vm_t vm = { .pc = 0, .put = put, .get = get, .ready = ready, .in = stdin, .out = stdout, .debug = option("DEBUG") ? stderr : NULL, };
 	if (argc < 2) {
-		(void)fprintf(stderr, "Usage: %s prog.hex\n", argv[0]);
+		(void)fprintf(stderr, "Usage: %s prog.hex [source.fth...]\n", argv[0]);
 		return 1;
 	}
-	FILE *prog = fopen(argv[1], "rb");
-	if (!prog) {
+	if (image_load(&image, argv[1]) < 0) {
 		(void)fprintf(stderr, "Unable to open file `%s` for reading\n", argv[1]);
 		return 2;
 	}
-	for (size_t i = 0; i < SZ; i++) {
-		unsigned long d = 0;
-		if (fscanf(prog, "%lx,", &d) != 1) /* optional comma */
-			break;
-		vm.m[i] = d;
+	const char *tracing = getenv("TRACE");
+	trace_t trace = { .f = tracing ? fopen(tracing, "wb") : NULL, .start = seconds(), .rp0 = image.m[RPCELL],
+		.limit = option("TRACEDEPTH") > 0 ? (option("TRACEDEPTH") < 64 ? option("TRACEDEPTH") : 64) : 16, };
+	if (tracing && !trace.f) {
+		(void)fprintf(stderr, "Unable to open file `%s` for writing\n", tracing);
+		return 3;
+	}
+	if (trace.f)
+		vm.trace = &trace;
+	const long instances = option("INSTANCES");
+	if (instances > 1 && (option("CLOCK") > 0 || option("BAUD") > 0 || option("WCET") || option("HOST")
+			|| getenv("HEATMAP") || getenv("SAVE") || getenv("SNAPSHOT") || getenv("RESTORE") || getenv("CACHE"))) {
+		(void)fprintf(stderr, "INSTANCES cannot be used with CLOCK, BAUD, HEATMAP, WCET, HOST, SAVE, SNAPSHOT, RESTORE or CACHE\n");
+		return 2;
+	}
+	const char *save = getenv("SAVE"), *restore = getenv("RESTORE"), *snapshot = getenv("SNAPSHOT");
+	const long every = option("CHECKPOINT") > 0 ? option("CHECKPOINT") : -1;
+	FILE *snaps = snapshot ? fopen(snapshot, "ab") : NULL;
+	if (snapshot && !snaps) {
+		(void)fprintf(stderr, "Unable to open file `%s` for writing\n", snapshot);
+		return 3;
+	}
+	feed_t feed = { .v = &vm, .files = &argv[2], .count = argc - 2, .stats = option("STATS") ? stderr : NULL, .hold = save || (snaps && every < 0), };
+	if (feed.count > 0 || feed.hold) {
+		vm.get = get_feed;
+		vm.ready = ready_feed;
+		vm.in = &feed;
+	}
+	if (feed.hold)
+		vm.opts |= OEOF;
+	const char *hooks = getenv("HOOKS");
+	if (hooks && !(vm.hooks = hooks_load(hooks))) {
+		(void)fprintf(stderr, "Unable to load hooks from `%s`\n", hooks);
+		return 2;
+	}
+	if (option("VERIFY"))
+		vm.opts |= OVERIFY;
+	if (option("HOST"))
+		vm.opts |= OHOST;
+	if (option("LUT"))
+		vm.opts |= OLUT;
+	if (option("BARREL"))
+		vm.opts |= OBARREL;
+	if (option("EXECUTE"))
+		vm.opts |= OXEQ;
+	if (option("LINK"))
+		vm.opts |= OLINK;
+	if (option("NEXTUNIT"))
+		vm.opts |= ONEXT;
+	if (option("PCBITS") > 8 && option("PCBITS") <= PCMAX) { /* maximal length polynomials, see `pc_length` */
+		static const uint16_t polys[] = { 0x110, 0x240, 0x500, };
+		vm.pcmsk = (1u << option("PCBITS")) - 1u;
+		vm.poly = polys[option("PCBITS") - 9];
+	}
+	if (getenv("POLY"))
+		vm.poly = strtol(getenv("POLY"), NULL, 0);
+	if (option("IRQ") > 0) { /* interrupt on input, as `top.vhd` does when the UART receives a byte */
+		vm.opts |= OIRQ | ORX;
+		if (setvbuf(stdin, NULL, _IONBF, 0)) {
+			(void)fprintf(stderr, "Unable to unbuffer stdin\n");
+			return 2;
+		}
+	}
+	if (option("IOBUS")) {
+		vm.opts |= OBUS;
+		if (setvbuf(stdin, NULL, _IONBF, 0)) {
+			(void)fprintf(stderr, "Unable to unbuffer stdin\n");
+			return 2;
+		}
+	}
+	if (option("TIMER") > 0) {
+		vm.opts |= OIRQ;
+		vm.tick = vm.next = option("TIMER");
+	}
+	if (option("BANKS") > 0) {
+		if (option("BANKS") > 0x100 || option("BANKS") & (option("BANKS") - 1)) {
+			(void)fprintf(stderr, "BANKS must be a power of two up to 256\n");
+			return 2;
+		}
+		vm.banks = option("BANKS");
+		if (!(vm.ext = calloc((size_t)vm.banks * SZ, sizeof *vm.ext))) {
+			(void)fprintf(stderr, "Unable to allocate %u banks\n", (unsigned)vm.banks);
+			return 2;
+		}
+	}
+	if ((snaps || restore) && (vm.ext || vm.opts & (OLUT | OXEQ | OIRQ | OBUS))) { /* state a snapshot does not hold */
+		(void)fprintf(stderr, "Snapshots cannot be used with LUT, EXECUTE, IRQ, TIMER, IOBUS or BANKS\n");
+		return 2;
+	}
+	const char *heatmap = getenv("HEATMAP");
+	if (option("WCET") && (vm.hooks || vm.ext || vm.opts & (OHOST | OIRQ | OLUT | OBARREL | OXEQ | OLINK | ONEXT | OBUS))) {
+		(void)fprintf(stderr, "WCET analysis only supports the base instruction set, without hooks, banks, IOBUS or HOST\n");
+		return 2;
+	}
+	if (option("WCET") && (!(vm.wcet = calloc(SZ, sizeof *vm.wcet)) || !(vm.heat = calloc(SZ, sizeof *vm.heat)))) {
+		(void)fprintf(stderr, "Unable to allocate WCET tables\n");
+		return 2;
+	}
+	if (heatmap && !vm.heat && !(vm.heat = calloc(SZ, sizeof *vm.heat))) {
+		(void)fprintf(stderr, "Unable to allocate heatmap\n");
+		return 2;
+	}
+	const char *profile = getenv("OPTIMISE");
+	if (profile) {
+		static heat_t h[SZ];
+		long saved = 0, n = 0;
+		FILE *f = fopen(profile, "rb");
+		const int bad = !f || heat_read(f, h) < 0;
+		if (f) (void)fclose(f);
+		if (bad) {
+			(void)fprintf(stderr, "Unable to read heatmap from `%s`\n", profile);
+			return 2;
+		}
+		n = optimise(&image, h, vm.opts, &saved);
+		if (feed.stats)
+			(void)fprintf(stderr, "Rewrote %ld indirect instructions, saving %ld indirections in the profile\n", n, saved);
+	}
+	if (instances > 1) {
+		const int r = pool_main(&vm, &image, &argv[2], argc - 2, instances);
+		if (trace.f && fclose(trace.f) < 0) return 1;
+		free((void*)vm.hooks);
+		free(vm.ext);
+		return r < 0;
+	}
+	pace_t pace = { .hz = option("CLOCK") > 0 ? option("CLOCK") : 100000000, .start = seconds(), };
+	if (option("CLOCK") > 0 || option("BAUD") > 0) {
+		pace.frame = option("BAUD") > 0 ? 10 * pace.hz / option("BAUD") : 0; /* start, 8 data, stop bits */
+		vm.pace = &pace;
+	}
+	attach(&vm, &image);
+	snap_t snap = { .d = NULL, };
+	long taken = 0, bytes = 0;
+	int r = 0;
+	const double began = seconds();
+	if (restore && (snap_load(restore, option("REWIND"), &snap) < 0 || snap_restore(&vm, &image, &snap) < 0)) {
+		(void)fprintf(stderr, "Unable to restore snapshot from `%s`\n", restore);
+		r = -1;
+		goto done;
+	}
+	if (restore && vm.trace)
+		trace_span(vm.trace, vm.id, "restore", began, vm.cycles);
+	/* Not used with options that keep state a snapshot does not hold */
+	const char *cache = restore || vm.ext || vm.opts & (OHOST | OIRQ | OLUT | OBUS) ? NULL : getenv("CACHE");
+	char cached[4096] = { 0, };
+	uint64_t key = 0;
+	tee_t tee = { .put = vm.put, .out = vm.out, };
+	if (cache) {
+		key = cache_key(&image, &vm, &argv[2], argc - 2);
+		(void)snprintf(cached, sizeof cached, "%s/%016llx.cache", cache, (unsigned long long)key);
+		const double start = seconds();
+		if (cache_load(cached, key, &snap, &tee) == 0 && snap_restore(&vm, &image, &snap) == 0) {
+			if (vm.trace)
+				trace_span(vm.trace, vm.id, "cache load", start, vm.cycles);
+			for (size_t i = 0; i < tee.len; i++)
+				(void)vm.put(vm.out, tee.b[i]);
+			feed.count = -1; /* already read, though a `SAVE` is still made when input is wanted */
+			cache = NULL;
+		} else {
+			tee = (tee_t) { .put = vm.put, .out = vm.out, };
+			detach(&vm);
+			attach(&vm, &image);
+			feed.hold = 1;
+			vm.opts |= OEOF;
+			vm.get = get_feed;
+			vm.ready = ready_feed;
+			vm.in = &feed;
+			vm.put = put_tee;
+			vm.out = &tee;
+		}
+	}
+	if (!snaps && !cache && flatten(&vm) < 0) { /* nothing will look for shared pages */
+		(void)fprintf(stderr, "Unable to allocate memory\n");
+		r = -1;
+		goto done;
+	}
+	double took = 0;
+	while ((r = run(&vm, every)) != HALTED && r >= 0) {
+		if (r == EXHAUSTED) { /* waiting on input after the source files, the image resumes here */
+			vm.opts &= ~OEOF;
+			if (cache) {
+				const double start = seconds();
+				if (cache_save(cached, key, &vm, &image, &snap, &tee) < 0)
+					(void)fprintf(stderr, "Unable to write cache `%s`\n", cached);
+				else if (vm.trace)
+					trace_span(vm.trace, vm.id, "cache save", start, vm.cycles);
+				vm.put = tee.put;
+				vm.out = tee.out;
+				cache = NULL;
+				if (!save && !snaps) continue; /* only held for the cache */
+			}
+			if (save && image_save(&vm, save, vm.pc) < 0) {
+				(void)fprintf(stderr, "Unable to save image to `%s`\n", save);
+				r = -1;
+				break;
+			}
+			if (every >= 0) continue;
+		}
+		if (snaps) {
+			const double start = seconds();
+			if (snap_take(&vm, &image, &snap) < 0 || snap_write(snaps, &snap) < 0) {
+				(void)fprintf(stderr, "Unable to write snapshot to `%s`\n", snapshot);
+				r = -1;
+				break;
+			}
+			took += seconds() - start;
+			taken++;
+			if (vm.trace)
+				trace_span(vm.trace, vm.id, "snapshot", start, vm.cycles);
+			bytes += (9 + snap.len) * 2;
+		}
+	}
+	if (feed.stats && taken)
+		(void)fprintf(stderr, "Snapshots %ld, bytes %ld, seconds %g\n", taken, bytes, took);
+	if (feed.stats && vm.pace)
+		(void)fprintf(stderr, "Instructions %ld, clocks %llu, clocks/instruction %g, modelled seconds %g\n",
+				vm.cycles, pace.clocks, vm.cycles ? (double)pace.clocks / vm.cycles : 0, pace.clocks / pace.hz);
+	if (vm.wcet && wcet_show(stderr, &vm, &image) < 0) {
+		(void)fprintf(stderr, "Unable to analyse WCET\n");
+		r = -1;
+	}
+	if (heatmap) {
+		FILE *f = fopen(heatmap, "wb");
+		if (!f || heat_write(f, vm.heat) < 0 || (feed.stats && heat_show(stderr, vm.heat) < 0)) {
+			(void)fprintf(stderr, "Unable to write heatmap to `%s`\n", heatmap);
+			r = -1;
+		}
+		if (f && fclose(f) < 0) r = -1;
+	}
+done:
+	if (trace.f) {
+		trace_close(&trace, &vm, 1);
+		if (fclose(trace.f) < 0) r = -1;
 	}
-	if (fclose(prog) < 0) return 3;
-	return run(&vm) < 0;
+	free(snap.d);
+	free(tee.b);
+	if (snaps && fclose(snaps) < 0) r = -1;
+	for (size_t i = 0; i < HFILES; i++)
+		if (vm.files[i] && fclose(vm.files[i]) < 0)
+			r = -1;
+	detach(&vm);
+	(void)unmap(&feed);
+	free((void*)vm.hooks);
+	free(vm.ext);
+	free(vm.heat);
+	free(vm.wcet);
+	return r < 0;
 }
@@ -43,7 +43,17 @@
 -- an indirect load, a jump into an indirect jump, or loading a full 16-bit value 
 -- to be AND'ed with the accumulator).
 --
--- There are no interrupts.
+-- Interrupts are optional, see the `interrupt_enable` generic. When the
+-- `irq` line is high and interrupts are unmasked, the instruction about to
+-- be fetched is not executed, instead the PC and accumulator are saved to
+-- the cells `irq_pc` and `irq_acc` and execution continues at `irq_vector`,
+-- which usually holds a jump to the handler. Interrupts are then masked
+-- until an indirect jump through `irq_pc`, which is how a handler returns
+-- (after loading the accumulator back from `irq_acc`), and they are also
+-- masked from reset, a program unmasks them by storing where it wants to
+-- continue to `irq_pc` and jumping through it. `irq` is level triggered,
+-- the handler has to clear whatever raised it. The default cells are
+-- unused by the eForth image.
 --
 -- If you find a use for this CPU, please let me know, it has been made just
 -- for fun and I doubt it has practical applications.
@@ -64,11 +74,26 @@
 -- just to show what is possible, to show how flexible you can make your
 -- modules.
 --
--- One interesting instruction would be to use a 2:1 4-bit LUT applied to
--- each bit of the ALU inputs in turn, allowing us to implement any of the
--- 16 binary logic operators. We would also need a method of setting the 4-bit
--- LUT, which could perhaps be tacked on to a JUMP instruction as we are only
--- using 8 of the 12 bits available to us.
+-- With the `lut_enable` generic the XOR instruction instead applies a 2:1
+-- 4-bit LUT to each bit of the ALU inputs in turn, allowing us to implement
+-- any of the 16 binary logic operators. The LUT is indexed by the accumulator
+-- bit times two plus the operand bit, and is set by the top four bits of the
+-- operand of a direct JUMP, which only uses 8 of the 12 bits available to it.
+-- Those bits are XOR'd with "0110" first, so a jump with them clear selects
+-- XOR and existing programs run unchanged. OR is "1110", AND is "1000".
+--
+-- The `execute_enable` generic turns a direct jump to zero, which nothing
+-- jumps to as the LFSR never reaches it, into an instruction that executes
+-- the accumulator as the next instruction, after which execution carries on
+-- from the instruction after the jump (unless it was a jump). A threaded
+-- interpreter whose tokens are instructions can dispatch with it in a step.
+--
+-- The `link_enable` generic makes a direct jump with the top bit of its
+-- operand set also store the address of the instruction after it to the
+-- cell `link_cell`, a subroutine then returns with an indirect jump through
+-- that cell. The default is the cell the eForth kernel already uses for
+-- returning, so its calls of three instructions become one. It cannot be
+-- used with `lut_enable`, which uses the same bits.
 --
 
 library ieee, work, std;
@@ -89,6 +114,15 @@ entity lfsr is
 		add_instead_of_lsl1: boolean    := false;  -- use add instead of A_LSL1
 		pc_is_lfsr:          boolean    := true;   -- switch between using a counter and using a LFSR
 		halt_enable:         boolean    := false;  -- a jump to self causes `halted` to be raised
+		interrupt_enable:    boolean    := false;  -- enable the `irq` line
+		irq_vector:          natural    := 16#02#; -- PC an interrupt jumps to
+		irq_pc:              natural    := 16#04#; -- cell the PC is saved to
+		irq_acc:             natural    := 16#08#; -- cell the accumulator is saved to
+		lut_enable:          boolean    := false;  -- replace A_XOR with a LUT set by A_JMP
+		barrel_shift:        boolean    := false;  -- shift the accumulator by the operand in A_LSL1/A_LSR1
+		execute_enable:      boolean    := false;  -- a direct jump to zero executes the accumulator
+		link_enable:         boolean    := false;  -- a direct jump with the top operand bit set links
+		link_cell:           natural    := 16#10C#; -- cell the return address of a linking jump goes to
 		debug:               natural    := 0);     -- debug level, 0 = off
 	port (
 		clk:           in std_ulogic; -- Guess what this is?
@@ -102,6 +136,7 @@ entity lfsr is
 		obsy, ihav:    in std_ulogic; -- Output busy / Have input
 		io_we, io_re: out std_ulogic; -- Write and read enable for I/O
 		pause:         in std_ulogic; -- pause the CPU in the `S_FETCH` state
+		irq:           in std_ulogic := '0'; -- interrupt request, if enabled
 		blocked:      out std_ulogic; -- is the CPU paused, or blocking on I/O?
 		halted:       out std_ulogic); -- Is the system halted?
 end;
@@ -117,7 +152,11 @@ architecture rtl of lfsr is
 		S_INDIRECT, -- Indirect through operand
 		S_STORE,    -- Store instruction
 		S_LOAD,     -- Load instruction
-		S_NEXT      -- No Jump, load next PC
+		S_NEXT,     -- No Jump, load next PC
+		S_IRQ0,     -- Save PC for interrupt
+		S_IRQ1,     -- Save accumulator and jump to interrupt vector
+		S_EXEC,     -- Execute accumulator as an instruction
+		S_LINK      -- Save return address for a linking jump
 	);
 
 	type alu_t is (
@@ -137,6 +176,8 @@ architecture rtl of lfsr is
 		pc:    std_ulogic_vector(pc_length - 1 downto 0); -- Program Counter
 		alu:   alu_t;   -- Used to store instruction
 		state: state_t; -- CPU State Register
+		ie:    std_ulogic; -- Interrupts unmasked
+		lut:   std_ulogic_vector(3 downto 0); -- Logic operation for `lut_enable`
 	end record;
 
 	constant registers_default: registers_t := (
@@ -144,10 +185,13 @@ architecture rtl of lfsr is
 		val   => (others => '0'),
 		pc    => (others => '0'),
 		alu   => A_XOR,
-		state => S_FETCH);
+		state => S_FETCH,
+		ie    => '0',
+		lut   => "0110");
 
 	signal c, f: registers_t := registers_default; -- All state is captured in here
-	signal jump, zero, dop: std_ulogic := '0'; -- Transient CPU Flags
+	signal jump, zero, dop, take: std_ulogic := '0'; -- Transient CPU Flags
+	signal ins: std_ulogic_vector(N - 1 downto 0) := (others => '0'); -- Instruction being executed
 	signal npc, rpc: std_ulogic_vector(pc_length - 1 downto 0) := (others => '0'); -- Potential next PC value
 	signal ra, rb, rout, raddr: std_ulogic_vector(N - 1 downto 0) := (others => '0'); -- ALU signals
 	signal rstate: state_t := S_FETCH; -- Computed next state signal from ALU
@@ -164,6 +208,23 @@ architecture rtl of lfsr is
 	constant JS_NEN: integer := 3; -- Enable Jumping on negative (high bit set)
 	constant JS_NC:  integer := 4; -- '1' = Jump on Negative, '0' = Jump on 
 
+	-- With `barrel_shift` the shift instructions no longer shift their
+	-- operand by one, instead the accumulator is shifted by the bottom four
+	-- bits of the operand, or rotated if the fifth bit is set. This is not
+	-- compatible with programs written for shifts by one, the eForth image
+	-- uses them to load constants, but `lshift` and `rshift` become single
+	-- instructions instead of loops.
+	function barrel(a, b: std_ulogic_vector; left: boolean) return std_ulogic_vector is
+		constant n: natural := to_integer(unsigned(b(3 downto 0)));
+	begin
+		if b(4) = '1' then
+			if left then return std_ulogic_vector(rotate_left(unsigned(a), n)); end if;
+			return std_ulogic_vector(rotate_right(unsigned(a), n));
+		end if;
+		if left then return std_ulogic_vector(shift_left(unsigned(a), n)); end if;
+		return std_ulogic_vector(shift_right(unsigned(a), n));
+	end function;
+
 	-- Obviously this does not synthesize, which is why synthesis is turned
 	-- off for the body of this procedure, it does make debugging much easier
 	-- when running a test-bench as we will be able to see which instructions are 
@@ -192,9 +253,9 @@ architecture rtl of lfsr is
 		-- C simulator when it has debugging turned on (modulo some extra messages
 		-- the VHDL test bench produces which should be obvious in a diff).
 		if debug = 2 then
-			if c.state = S_FETCH then
+			if (c.state = S_FETCH or c.state = S_EXEC) and take = '0' then
 				write(oline, uint(c.pc) & ": ");
-				write(oline, yn(i(i'high), 'i'));
+				write(oline, yn(ins(ins'high), 'i'));
 				write(oline, alu_t'image(alu) & " ");
 				write(oline, uint(c.acc));
 				writeline(OUTPUT, oline);
@@ -226,6 +287,9 @@ begin
 	--   assert not (io_re = '1' and io_we = '1') severity warning;
 
 	assert N >= 8 report "LFSR machine width too small, must be greater or equal to 8 bits" severity failure;
+	assert not lut_enable or pc_length <= N - 8 report "LUT bits overlap the PC" severity failure;
+	assert not (lut_enable and link_enable) report "LUT and link bits overlap" severity failure;
+	assert not link_enable or pc_length <= N - 5 report "link bit overlaps the PC" severity failure;
 
 	pc_lfsr: if pc_is_lfsr generate -- Super RAD Mode
 		gloop: for g in pc_length - 1 downto 0 generate
@@ -243,7 +307,9 @@ begin
 
 	zero  <= '1' when jspec(JS_ZEN) = '1' and c.acc = AZ else '0' after delay;
 	jump  <= '1' when (jspec(JS_NEN) = '1' and c.acc(c.acc'high) = jspec(JS_NC)) or zero = jspec(JS_ZC) else '0' after delay;
-	o     <= c.acc after delay;
+	take  <= '1' when interrupt_enable and c.ie = '1' and irq = '1' and pause = '0' else '0' after delay;
+	o     <= c.val when c.state = S_IRQ0 or c.state = S_LINK else c.acc after delay;
+	ins   <= c.acc when execute_enable and c.state = S_EXEC else i after delay;
 	obyte <= c.acc(obyte'range) after delay;
 	re    <= not dop after delay;
 	we    <= dop after delay;
@@ -267,11 +333,15 @@ begin
 				if c.state = S_LOAD then assert f.state = S_NEXT or f.state = S_LOAD; end if;
 				if c.state = S_STORE then assert f.state = S_NEXT or f.state = S_STORE; end if;
 				if c.state = S_NEXT then assert f.state = S_FETCH; end if;
+				if c.state = S_IRQ0 then assert f.state = S_IRQ1; end if;
+				if c.state = S_IRQ1 then assert f.state = S_NEXT; end if;
+				if c.state = S_EXEC then assert f.state /= S_NEXT and f.state /= S_EXEC; end if;
+				if c.state = S_LINK then assert f.state = S_NEXT; end if;
 			end if;
 		end if;
 	end process;
 
-	process (c.pc, jump, npc, ra, rb, alu, i) -- The ALU
+	process (c.pc, c.lut, jump, npc, ra, rb, alu, i) -- The ALU
 	begin
 		rout <= ra after delay;
 		raddr <= (others => '0') after delay;
@@ -280,24 +350,33 @@ begin
 		rstate <= S_FETCH after delay;
 		halted <= '0' after delay;
 		case alu is
-		when A_XOR => rout <= ra xor rb after delay;
+		when A_XOR =>
+			if lut_enable then
+				for j in rout'range loop
+					rout(j) <= c.lut(to_integer(unsigned'(ra(j) & rb(j)))) after delay;
+				end loop;
+			else rout <= ra xor rb after delay; end if;
 		when A_AND => rout <= ra and rb after delay;
 		when A_LSL1 => 
 			if add_instead_of_lsl1 then rout <= std_ulogic_vector(unsigned(ra) + unsigned(rb)) after delay;
+			elsif barrel_shift then rout <= barrel(ra, rb, true) after delay;
 			else rout <= rb(rb'high - 1 downto 0) & "0" after delay; end if;
-		when A_LSR1 => rout <= "0" & rb(rb'high downto 1) after delay;
+		when A_LSR1 =>
+			if barrel_shift then rout <= barrel(ra, rb, false) after delay;
+			else rout <= "0" & rb(rb'high downto 1) after delay; end if;
 		when A_LOAD => raddr <= rb after delay; rstate <= S_LOAD after delay;
 		when A_STORE => raddr <= rb after delay; rstate <= S_STORE after delay;
 		when A_JMP => raddr <= rb after delay; rpc <= rb(rpc'range) after delay; rstate <= S_FETCH after delay; 
+			if lut_enable then raddr(raddr'high downto rpc'length) <= (others => '0') after delay; end if;
 			if halt_enable and rb(c.pc'range) = c.pc and c.state = S_FETCH and i(i'high) = '0' then halted <= '1' after delay; end if;
 		when A_JMPZ => if jump = jspec(JS_C) then raddr <= rb after delay; rpc <= rb(rpc'range) after delay; rstate <= S_FETCH after delay; end if;
 		end case;
 	end process;
 
-	process (c, i, ibyte, obsy, ihav, pause, rout, raddr, rstate, rpc) 
-		alias indirect is i(i'high); -- old versions of GHDL have problems with these aliases.
-		alias alubits is i(i'high - 1 downto i'high - 3);
-		alias operand is i(i'high - 4 downto 0);
+	process (c, i, ins, ibyte, obsy, ihav, pause, take, rout, raddr, rstate, rpc, npc) 
+		alias indirect is ins(ins'high); -- old versions of GHDL have problems with these aliases.
+		alias alubits is ins(ins'high - 1 downto ins'high - 3);
+		alias operand is ins(ins'high - 4 downto 0);
 	begin -- No microcode, just a state machine
 		f      <= c after delay;
 		io_we  <= '0' after delay;
@@ -311,23 +390,40 @@ begin
 		rb(operand'range) <= operand after delay;
 
 		case c.state is
-		when S_FETCH =>
+		when S_FETCH | S_EXEC => -- `S_EXEC` is `S_FETCH` with the instruction taken from `acc`
 			f.alu <= alu_t'val(to_integer(unsigned(alubits))) after delay;
 			f.val <= (others => '0') after delay;
 			f.val(operand'range) <= operand after delay;
 			if pause = '1' then
-				f.state <= S_FETCH after delay;
+				f.state <= c.state after delay;
+			elsif take = '1' then
+				f.val <= (others => '0') after delay;
+				f.val(c.pc'range) <= c.pc after delay;
+				f.state <= S_IRQ0 after delay;
 			elsif indirect = '1' then
 				a <= (others => '0');
 				a(operand'range) <= operand after delay;
 				f.state <= S_INDIRECT after delay;
+			elsif execute_enable and c.state = S_FETCH and alu_t'val(to_integer(unsigned(alubits))) = A_JMP and unsigned(operand) = 0 then
+				f.state <= S_EXEC after delay; -- the PC is not advanced until the accumulator is executed
 			else
 				a <= raddr after delay;
 				f.acc <= rout after delay;
 				f.state <= rstate after delay;
 				f.pc <= rpc after delay;
+				if lut_enable and alu_t'val(to_integer(unsigned(alubits))) = A_JMP then
+					f.lut <= operand(operand'high downto operand'high - 3) xor "0110" after delay;
+				end if;
+				if link_enable and alu_t'val(to_integer(unsigned(alubits))) = A_JMP and operand(operand'high) = '1' then
+					f.val <= (others => '0') after delay;
+					f.val(npc'range) <= npc after delay;
+					f.state <= S_LINK after delay;
+				end if;
 			end if;
 		when S_INDIRECT =>
+			if interrupt_enable and c.alu = A_JMP and unsigned(c.val) = irq_pc then
+				f.ie <= '1' after delay; -- return from interrupt
+			end if;
 			rb <= i after delay;
 			alu <= c.alu after delay;
 			a <= raddr after delay;
@@ -372,6 +468,20 @@ begin
 		when S_NEXT =>
 			f.state <= S_FETCH after delay;
 			a(c.pc'range) <= c.pc after delay;
+		when S_IRQ0 =>
+			a <= std_ulogic_vector(to_unsigned(irq_pc, N)) after delay;
+			dop <= '1' after delay;
+			f.state <= S_IRQ1 after delay;
+		when S_LINK =>
+			a <= std_ulogic_vector(to_unsigned(link_cell, N)) after delay;
+			dop <= '1' after delay;
+			f.state <= S_NEXT after delay;
+		when S_IRQ1 =>
+			a <= std_ulogic_vector(to_unsigned(irq_acc, N)) after delay;
+			dop <= '1' after delay;
+			f.pc <= std_ulogic_vector(to_unsigned(irq_vector, pc_length)) after delay;
+			f.ie <= '0' after delay;
+			f.state <= S_NEXT after delay;
 		end case;
 	end process;
 end architecture;
@@ -0,0 +1,27 @@
+-- File:        nopty.vhd
+-- Author:      Richard James Howe
+-- Repository:  https://github.com/howerj/lfsr-vhdl
+-- Email:       howe.r.j.89@gmail.com
+-- License:     0BSD / Public Domain
+-- Description: Test bench without the pseudo-terminal bridge
+--
+-- Used in place of `pty.vhd` unless `PTY=1` is given to `make`, so the
+-- test bench elaborates with any GHDL back end. The `Pty.....` option of
+-- the test bench configuration cannot be used without the bridge.
+package pty_pkg is
+	impure function pty_getc return integer;
+	procedure pty_putc(ch: integer);
+end package;
+
+package body pty_pkg is
+	impure function pty_getc return integer is
+	begin
+		assert false report "Built without the PTY bridge, use `make pty`" severity failure;
+		return -1;
+	end function;
+
+	procedure pty_putc(ch: integer) is
+	begin
+		assert false report "Built without the PTY bridge, use `make pty`" severity failure;
+	end procedure;
+end package body;
@@ -0,0 +1,48 @@
+/* Pseudo-terminal bridge for the VHDL test bench, called from `tb.vhd`
+ * with VHPIDIRECT. The simulated UART is connected to a pseudo-terminal
+ * which can be talked to with `picocom` or any other terminal program,
+ * the name of which is printed when it is opened. Input is polled and
+ * never blocks, so the simulation keeps running while nothing is typed. */
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+
+static int master = -1, slave = -1;
+
+static int pty_open(void) { /* opened on first use */
+	if (master >= 0) return master;
+	const char *name = NULL;
+	struct termios t;
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0) goto fail;
+	if (grantpt(master) < 0 || unlockpt(master) < 0 || !(name = ptsname(master))) goto fail;
+	/* Keeping the slave open stops reads failing while no terminal is attached */
+	if ((slave = open(name, O_RDWR | O_NOCTTY)) < 0) goto fail;
+	if (tcgetattr(slave, &t) < 0) goto fail;
+	t.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+	t.c_oflag &= ~OPOST;
+	t.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+	t.c_cflag &= ~(CSIZE | PARENB);
+	t.c_cflag |= CS8;
+	if (tcsetattr(slave, TCSANOW, &t) < 0) goto fail;
+	if (fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK) < 0) goto fail;
+	(void)fprintf(stderr, "PTY: %s\n", name);
+	return master;
+fail:
+	(void)fprintf(stderr, "PTY: unable to open pseudo-terminal\n");
+	exit(1);
+}
+
+int32_t pty_getc(void) { /* -1 if there is no input yet */
+	unsigned char ch = 0;
+	return read(pty_open(), &ch, 1) == 1 ? ch : -1;
+}
+
+void pty_putc(int32_t ch) {
+	const unsigned char b = ch;
+	if (write(pty_open(), &b, 1) != 1)
+		return; /* dropped, as a UART with nobody listening would */
+}
@@ -0,0 +1,30 @@
+-- File:        pty.vhd
+-- Author:      Richard James Howe
+-- Repository:  https://github.com/howerj/lfsr-vhdl
+-- Email:       howe.r.j.89@gmail.com
+-- License:     0BSD / Public Domain
+-- Description: Pseudo-terminal bridge for the test bench
+--
+-- The bridge is written in C, in `pty.c`, and linked in when the test
+-- bench is elaborated with `PTY=1`, which needs a GHDL back end that can
+-- link objects (LLVM or GCC), these bodies are never called. Otherwise
+-- `nopty.vhd` is analysed instead.
+package pty_pkg is
+	impure function pty_getc return integer;
+	attribute foreign of pty_getc: function is "VHPIDIRECT pty_getc";
+	procedure pty_putc(ch: integer);
+	attribute foreign of pty_putc: procedure is "VHPIDIRECT pty_putc";
+end package;
+
+package body pty_pkg is
+	impure function pty_getc return integer is
+	begin
+		assert false report "VHPIDIRECT pty_getc" severity failure;
+		return -1;
+	end function;
+
+	procedure pty_putc(ch: integer) is
+	begin
+		assert false report "VHPIDIRECT pty_putc" severity failure;
+	end procedure;
+end package body;
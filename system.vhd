@@ -29,7 +29,20 @@ entity system is
 		file_name: string          := "lfsr.hex";
 		N:         positive        := 16;
 		debug:     natural         := 0; -- will not synthesize if greater than zero (debug off = 0)
-		halt_enable: boolean       := false
+		bank_bits: natural         := 0; -- log2 of the number of banks of extended memory, 0 = none
+		halt_enable: boolean       := false;
+		interrupt_enable: boolean  := false;
+		pc_length: positive        := 8;     -- 9 runs `lfsr-wide.hex`, 10 and 11 need an image of their own
+		polynomial: std_ulogic_vector(15 downto 0) := x"00B8"; -- maximal length for `pc_length`
+		next_unit: boolean         := false; -- Forth IP register, for `lfsr-next.hex`
+		ip_cell:   natural         := 16#105#; -- cell the kernel keeps IP in
+		next_addr: natural         := 16#7FFD#; -- reading here fetches through IP and increments it
+		io_bus:    boolean         := false; -- decode `bus_base` to `bus_base+15` onto the register bus
+		bus_base:  natural         := 16#7FE0#; -- first of the 16 cells of the register bus
+		lut_enable: boolean        := false; -- for `lfsr-lut.hex`, see `lfsr.vhd`
+		barrel_shift: boolean      := false;
+		execute_enable: boolean    := false;
+		link_enable: boolean       := false  -- for `lfsr-link.hex`
 	);
 	port (
 		clk:           in std_ulogic;
@@ -41,6 +54,16 @@ entity system is
 		obyte:        out std_ulogic_vector(7 downto 0);
 		ibyte:         in std_ulogic_vector(7 downto 0);
 		obsy, ihav:    in std_ulogic;
+		irq:           in std_ulogic := '0';
+		-- RAM can be written through these while the CPU is held in reset
+		load_we:       in std_ulogic := '0';
+		load_addr:     in std_ulogic_vector(N - 1 downto 0) := (others => '0');
+		load_data:     in std_ulogic_vector(N - 1 downto 0) := (others => '0');
+		-- Peripheral registers, used with `io_bus`
+		bus_addr:     out std_ulogic_vector(3 downto 0);
+		bus_dout:     out std_ulogic_vector(N - 1 downto 0);
+		bus_din:       in std_ulogic_vector(N - 1 downto 0) := (others => '0');
+		bus_we, bus_re: out std_ulogic;
 		io_we, io_re: out std_ulogic);
 end entity;
 
@@ -50,6 +73,14 @@ architecture rtl of system is
 
 	signal i, o, a: std_ulogic_vector(N - 1 downto 0) := (others => 'U');
 	signal re, we:  std_ulogic := 'U';
+	signal mi:      std_ulogic_vector(N - 1 downto 0) := (others => 'U'); -- main RAM output
+	signal mwe:     std_ulogic := 'U'; -- main RAM write enable
+	signal la, lo:  std_ulogic_vector(N - 1 downto 0) := (others => 'U'); -- main RAM address and input
+	signal lwe:     std_ulogic := 'U';
+	signal ri:      std_ulogic_vector(N - 1 downto 0) := (others => 'U'); -- memory output, before the NEXT unit
+	signal ma:      std_ulogic_vector(N - 1 downto 0) := (others => 'U'); -- main RAM address, after it
+	signal di:      std_ulogic_vector(N - 1 downto 0) := (others => 'U'); -- memory or register bus output
+	signal on_bus, bsel: std_ulogic := '0'; -- `a` is on the register bus, and was when the read was made
 
 	procedure print_debug_info is -- Not synthesize-able, hence synthesis turned off
 		variable oline: line;
@@ -77,6 +108,7 @@ architecture rtl of system is
 	end procedure;
 begin
 	assert not (re = '1' and we = '1') severity warning;
+	assert bus_base mod 16 = 0 report "register bus not aligned" severity failure;
 
 	-- synthesis translate_off
 	process (clk) begin
@@ -91,8 +123,15 @@ begin
 			asynchronous_reset => g.asynchronous_reset,
 			delay              => g.delay,
 			N                  => N,
+			pc_length          => pc_length,
+			polynomial         => polynomial,
 			debug              => debug,
-			halt_enable        => halt_enable)
+			halt_enable        => halt_enable,
+			interrupt_enable   => interrupt_enable,
+			lut_enable         => lut_enable,
+			barrel_shift       => barrel_shift,
+			execute_enable     => execute_enable,
+			link_enable        => link_enable)
 		port map (
 			clk     => clk, 
 			rst     => rst,
@@ -101,6 +140,7 @@ begin
 			blocked => blocked,
 			-- synthesis translate_on
 			pause   => '0',
+			irq     => irq,
 			i       => i,
 			o       => o, 
 			a       => a, 
@@ -113,6 +153,10 @@ begin
 			obyte   => obyte,
 			ibyte   => ibyte);
 
+	la  <= load_addr when load_we = '1' else ma;
+	lo  <= load_data when load_we = '1' else o;
+	lwe <= load_we or (mwe and not on_bus);
+
 	bram: entity work.single_port_block_ram
 		generic map(
 			g           => g,
@@ -122,11 +166,181 @@ begin
 			data_length => data_length)
 		port map (
 			clk  => clk,
-			dwe  => we,
-			addr => a(addr_length - 1 downto 0),
+			dwe  => lwe,
+			addr => la(addr_length - 1 downto 0),
 			dre  => re,
-			din  => o,
-			dout => i);
+			din  => lo,
+			dout => mi);
+
+	unbanked: if bank_bits = 0 generate
+		ri  <= mi;
+		mwe <= we;
+	end generate;
+
+	-- Cells `$1000-$1FFF` are a window onto one of `2**bank_bits` banks of
+	-- extended memory, each a Block RAM of its own, chosen by writing to the
+	-- bank register at `$7FFF`. Both alias the main RAM when there are no
+	-- banks. Instructions can only reach them through a pointer, which is
+	-- how Forth accesses memory anyway, at the normal speed of a load or
+	-- store. This matches `BANKS` in the C VM.
+	banked: if bank_bits > 0 generate
+		type banks_t is array (0 to 2 ** bank_bits - 1) of std_ulogic_vector(N - 1 downto 0);
+		signal bi: banks_t;
+		signal bank, last: std_ulogic_vector(bank_bits - 1 downto 0) := (others => '0');
+		signal in_window, on_reg: std_ulogic := '0';
+		signal sel: std_ulogic_vector(1 downto 0) := "00"; -- what `a` was when the read was made
+	begin
+		in_window <= '1' when a(N - 1 downto addr_length) = std_ulogic_vector(to_unsigned(1, N - addr_length)) else '0';
+		on_reg    <= '1' when a = std_ulogic_vector(to_unsigned(2 ** (N - 1) - 1, N)) else '0';
+		mwe       <= we and not in_window and not on_reg;
+
+		process (clk, rst) begin
+			if rst = '1' and g.asynchronous_reset then
+				bank <= (others => '0');
+			elsif rising_edge(clk) then
+				sel  <= in_window & on_reg;
+				last <= bank;
+				if rst = '1' and not g.asynchronous_reset then
+					bank <= (others => '0');
+				elsif we = '1' and on_reg = '1' then
+					bank <= o(bank'range);
+				end if;
+			end if;
+		end process;
+
+		process (sel, mi, bi, last) begin -- Block RAM output arrives a clock after the address
+			ri <= mi;
+			if sel(1) = '1' then
+				ri <= bi(to_integer(unsigned(last)));
+			end if;
+			if sel(0) = '1' then
+				ri <= (others => '0');
+				ri(last'range) <= last;
+			end if;
+		end process;
+
+		gbank: for b in banks_t'range generate
+			signal bwe: std_ulogic;
+		begin
+			bwe <= we and in_window when to_integer(unsigned(bank)) = b else '0';
+
+			ram: entity work.single_port_block_ram
+				generic map(
+					g           => g,
+					file_name   => file_name,
+					file_type   => FILE_NONE,
+					addr_length => addr_length,
+					data_length => data_length)
+				port map (
+					clk  => clk,
+					dwe  => bwe,
+					addr => a(addr_length - 1 downto 0),
+					dre  => re,
+					din  => o,
+					dout => bi(b));
+		end generate;
+	end generate;
+
+	-- With `io_bus` the 16 cells from `bus_base` (Forth addresses `$FFC0` to
+	-- `$FFDE` by default) are not RAM but the registers of peripherals
+	-- decoded in the next module up, which see the bottom four bits of the
+	-- address, the full width of the data, and the read and write enables.
+	-- Like Block RAM a register is written on the clock edge and a read
+	-- returns its value on the following clock, so a load or store takes the
+	-- same time as any other, unlike the byte stream of the I/O space which
+	-- waits for `ihav` and `obsy` and only carries 8 bits. Reads must not
+	-- have side effects as the CPU reads an address for two clocks during a
+	-- load, and reads the destination of an indirect store before writing.
+	-- See `top.vhd` for the registers it decodes.
+	nobus: if not io_bus generate
+		on_bus   <= '0';
+		di       <= ri;
+		bus_addr <= (others => '0');
+		bus_dout <= (others => '0');
+		bus_we   <= '0';
+		bus_re   <= '0';
+	end generate;
+
+	regs: if io_bus generate
+		on_bus   <= '1' when a(N - 1 downto 4) = std_ulogic_vector(to_unsigned(bus_base / 16, N - 4)) else '0';
+		di       <= bus_din when bsel = '1' else ri;
+		bus_addr <= a(3 downto 0);
+		bus_dout <= o;
+		bus_we   <= we and on_bus;
+		bus_re   <= re and on_bus;
+
+		process (clk) begin
+			if rising_edge(clk) then
+				bsel <= on_bus;
+			end if;
+		end process;
+	end generate;
+
+	nounit: if not next_unit generate
+		i  <= di;
+		ma <= a;
+	end generate;
+
+	-- The Forth inner interpreter spends most of its time fetching the
+	-- cell IP points to and incrementing IP, which without an adder takes
+	-- dozens of instructions. With `next_unit` cell `ip_cell` is instead a
+	-- register here, and reading `next_addr` (through a pointer, as it is
+	-- beyond the reach of an operand) returns the cell IP points to and
+	-- increments IP, so NEXT in `lfsr-next.hex` is four instructions. The
+	-- CPU keeps the address of a load on `a` for two clocks, the read is
+	-- made on the first and IP is only incremented then. On reset IP is
+	-- what the image holds in `ip_cell`, as the C VM with `NEXTUNIT` starts
+	-- with it, whether the image came from `file_name` or the loader port.
+	unit: if next_unit generate
+		impure function image_cell(the_file_name: in string; at: in natural) return std_ulogic_vector is
+			file     in_file:    text open read_mode is the_file_name;
+			variable input_line: line;
+			variable slv:        std_ulogic_vector(N - 1 downto 0) := (others => '0');
+		begin
+			for i in 0 to at loop
+				exit when endfile(in_file);
+				readline(in_file, input_line);
+				if i = at then
+					for j in 1 to (N / 4) loop
+						slv((j * 4) - 1 downto (j * 4) - 4) := hex_char_to_std_ulogic_vector_tb(input_line((N / 4) - j + 1));
+					end loop;
+				end if;
+			end loop;
+			file_close(in_file);
+			return slv;
+		end function;
+
+		constant ip_init: std_ulogic_vector(N - 1 downto 0) := image_cell(file_name, ip_cell);
+		signal ip, base: std_ulogic_vector(N - 1 downto 0) := ip_init; -- `base` follows the loader port
+		signal on_ip, on_next, on_load, was, sel: std_ulogic := '0';
+	begin
+		on_ip   <= '1' when a = std_ulogic_vector(to_unsigned(ip_cell, N)) else '0';
+		on_next <= '1' when a = std_ulogic_vector(to_unsigned(next_addr, N)) else '0';
+		on_load <= '1' when load_we = '1' and load_addr = std_ulogic_vector(to_unsigned(ip_cell, N)) else '0';
+		ma      <= ip when on_next = '1' and re = '1' else a;
+		i       <= ip when sel = '1' else di;
+
+		process (clk, rst) begin
+			if rst = '1' and g.asynchronous_reset then -- the loader port is only used with a synchronous reset
+				ip  <= ip_init;
+				was <= '0';
+			elsif rising_edge(clk) then
+				sel <= on_ip;
+				was <= on_next;
+				if on_load = '1' then -- written while the CPU is held in reset
+					ip   <= load_data;
+					base <= load_data;
+				elsif rst = '1' and not g.asynchronous_reset then
+					ip  <= base;
+					was <= '0';
+				elsif we = '1' and on_ip = '1' then
+					ip <= o;
+				elsif re = '1' and on_next = '1' and was = '0' then
+					ip <= std_ulogic_vector(unsigned(ip) + 1);
+				end if;
+			end if;
+		end process;
+	end generate;
 end architecture;
 
 
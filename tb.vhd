@@ -11,6 +11,7 @@ use ieee.numeric_std.all;
 use work.util.all;
 use std.textio.all;
 use work.uart_pkg.all;
+use work.pty_pkg.all;
 
 entity tb is
 	-- With the GHDL simulator these generics can be overridden with
@@ -66,6 +67,7 @@ architecture testing of tb is
 		input_single_line: boolean;
 		uart_char_delay:   time;
 		crlf:              boolean;
+		pty:               boolean;
 	end record;
 
 	function set_configuration_items(ci: configuration_items) return configurable_items is
@@ -80,10 +82,11 @@ architecture testing of tb is
 		r.input_single_line := ci(6).value > 0;
 		r.uart_char_delay   := ci(7).value * 1 ms;
 		r.crlf              := ci(8).value > 0;
+		r.pty               := ci(9).value > 0;
 		return r;
 	end function;
 
-	constant configuration_default: configuration_items(0 to 8) := (
+	constant configuration_default: configuration_items(0 to 9) := (
 		(name => "Clocks..", value => 1000),
 		(name => "Forever.", value => 0),
 		(name => "Interact", value => 0),
@@ -92,7 +95,8 @@ architecture testing of tb is
 		(name => "LogFor..", value => 256),
 		(name => "1Line...", value => 1),
 		(name => "UChDelay", value => 6),
-		(name => "CRLF.EOF", value => 0)
+		(name => "CRLF.EOF", value => 0),
+		(name => "Pty.....", value => 0)
 	);
 
 	-- Test bench configurable options --
@@ -239,15 +243,22 @@ begin
 	begin
 		wait until configured;
 
-		if cfg.interactive < 1 then
+		if cfg.interactive < 1 and not cfg.pty then
 			report "Output process turned off (`interactive < 1`)";
 			wait;
 		end if;
 
-		report "Writing to STDOUT";
+		if cfg.pty then
+			report "Writing to PTY";
+		else
+			report "Writing to STDOUT";
+		end if;
 		while not stop loop
 			wait until rx_hav = '1' or stop;
-			if not stop then
+			if not stop and cfg.pty then
+				pty_putc(to_integer(unsigned(rx_data)));
+				wait for clock_period;
+			elsif not stop then
 				c := character'val(to_integer(unsigned(rx_data)));
 				if (cfg.report_uart) then
 					if isgraph(c) then
@@ -281,6 +292,7 @@ begin
 		variable iline: line;
 		variable good: boolean := true;
 		variable eoi:  boolean := false;
+		variable i:    integer := -1;
 
 		procedure write_byte(
 			ch: in character;
@@ -301,6 +313,28 @@ begin
 		tx_data <= x"00";
 		wait until configured;
 
+		-- Bytes from the pseudo-terminal are passed on as soon as the CPU
+		-- (or UART) will take them, it is polled in between.
+		if cfg.pty then
+			report "Reading from PTY";
+			while not stop loop
+				poll: loop
+					i := pty_getc;
+					exit poll when i >= 0 or stop;
+					wait for clock_period * 100;
+				end loop;
+				if i >= 0 then
+					if en_non_io_tb then
+						write_byte(character'val(i), io_re, stop, ihav, tx_data);
+					else
+						uart_write_byte(baud, std_ulogic_vector(to_unsigned(i, tx_data'length)), tx);
+					end if;
+				end if;
+			end loop;
+			report "Input process end";
+			wait;
+		end if;
+
 		if cfg.interactive < 2 then
 			report "Input process turned off (`interactive < 2`)";
 			wait;
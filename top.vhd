@@ -7,6 +7,19 @@
 --
 -- This module brings together the LFSR CPU/Memory subsystem with
 -- the I/O, which is a UART.
+--
+-- With `io_bus` the UART can also be reached through registers on the
+-- register bus of `system.vhd`, which never block, and a free running
+-- counter of clock cycles is added. The offsets are from `bus_base`:
+--
+--	0 | W | Transmit the bottom byte, dropped if the transmitter is busy
+--	1 | R | Received byte, bit 8 set if there is one, bit 9 if busy
+--	1 | W | Acknowledge the received byte, clearing bit 8
+--	2 | R | Clock cycles, bottom half
+--	3 | R | Clock cycles, top half
+--
+-- Other registers read as zero. The byte stream still works as before,
+-- both share the same UART.
 
 library ieee, work, std;
 use ieee.std_logic_1164.all;
@@ -21,7 +34,17 @@ entity top is
 		N:               positive        := 16;
 		baud:            positive        := 115200;
 		debug:           natural         := 0; -- will not synthesize if greater than zero (debug off = 0)
-		halt_enable:     boolean         := false
+		halt_enable:     boolean         := false;
+		interrupt_enable: boolean        := false; -- interrupt when a byte is received
+		bank_bits:       natural         := 0;     -- log2 of the number of banks of extended memory
+		pc_length:       positive        := 8;     -- 9 runs `lfsr-wide.hex`, 10 and 11 need an image of their own
+		polynomial:      std_ulogic_vector(15 downto 0) := x"00B8"; -- maximal length for `pc_length`
+		next_unit:       boolean         := false; -- Forth IP register, for `lfsr-next.hex`
+		io_bus:          boolean         := false; -- decode the UART and a counter as registers
+		lut_enable:      boolean         := false; -- these four are passed on to `lfsr.vhd`
+		barrel_shift:    boolean         := false;
+		execute_enable:  boolean         := false;
+		link_enable:     boolean         := false
 	);
 	port (
 		clk:         in std_ulogic;
@@ -43,17 +66,25 @@ architecture rtl of top is
 	type registers_t is record
 		hav: std_ulogic;
 		ibyte: std_ulogic_vector(7 downto 0);
+		clocks: unsigned(2 * N - 1 downto 0); -- for `io_bus`
+		rd: std_ulogic_vector(N - 1 downto 0); -- register read last clock
 	end record;
 
 	constant registers_default: registers_t := (
 		hav => '0',
-		ibyte => (others => '0')
+		ibyte => (others => '0'),
+		clocks => (others => '0'),
+		rd => (others => '0')
 	);
 
 	signal c, f: registers_t := registers_default;
 
 	signal bsy, hav, io_re, io_we: std_ulogic := 'U';
 	signal obyte, ibyte: std_ulogic_vector(7 downto 0) := (others => 'U');
+	signal bus_we, bus_re, tx_we: std_ulogic := 'U';
+	signal bus_addr: std_ulogic_vector(3 downto 0) := (others => 'U');
+	signal bus_dout: std_ulogic_vector(N - 1 downto 0) := (others => 'U');
+	signal tx_byte: std_ulogic_vector(7 downto 0) := (others => 'U');
 begin
 	assert not (io_re = '1' and io_we = '1') severity warning;
 
@@ -68,7 +99,7 @@ begin
 		end if;
 	end process;
 
-	process (c, hav, ibyte, io_re) begin
+	process (c, hav, ibyte, io_re, bsy, bus_we, bus_re, bus_addr) begin
 		f <= c after delay;
 
 		if hav = '1' then
@@ -79,15 +110,47 @@ begin
 		if io_re = '1' then
 			f.hav <= '0' after delay;
 		end if;
+
+		if io_bus then
+			f.clocks <= c.clocks + 1 after delay;
+			if bus_we = '1' and bus_addr = x"1" then
+				f.hav <= '0' after delay;
+			end if;
+			if bus_re = '1' then
+				f.rd <= (others => '0') after delay;
+				case bus_addr is
+				when x"1" =>
+					f.rd(7 downto 0) <= c.ibyte after delay;
+					f.rd(8) <= c.hav after delay;
+					f.rd(9) <= bsy after delay;
+				when x"2" => f.rd <= std_ulogic_vector(c.clocks(N - 1 downto 0)) after delay;
+				when x"3" => f.rd <= std_ulogic_vector(c.clocks(2 * N - 1 downto N)) after delay;
+				when others =>
+				end case;
+			end if;
+		end if;
 	end process;
 
+	tx_we   <= io_we or (bus_we and not bsy) when bus_addr = x"0" else io_we;
+	tx_byte <= bus_dout(7 downto 0) when io_we = '0' else obyte;
+
 	system: entity work.system
 	generic map(
 		g => g,
 		file_name => file_name,
 		N => N,
 		debug => debug,
-		halt_enable => halt_enable)
+		halt_enable => halt_enable,
+		interrupt_enable => interrupt_enable,
+		bank_bits => bank_bits,
+		pc_length => pc_length,
+		polynomial => polynomial,
+		next_unit => next_unit,
+		io_bus => io_bus,
+		lut_enable => lut_enable,
+		barrel_shift => barrel_shift,
+		execute_enable => execute_enable,
+		link_enable => link_enable)
 	port map (
 		clk     => clk,
 		rst     => rst,
@@ -99,6 +162,12 @@ begin
 		ibyte   => c.ibyte,
 		obsy    => bsy,
 		ihav    => c.hav,
+		irq     => c.hav,
+		bus_addr => bus_addr,
+		bus_dout => bus_dout,
+		bus_din => c.rd,
+		bus_we  => bus_we,
+		bus_re  => bus_re,
 		io_we   => io_we, 
 		io_re   => io_re);
 
@@ -106,8 +175,8 @@ begin
 		generic map(clks_per_bit => clks_per_bit, delay => delay)
 		port map(
 			clk => clk,
-			tx_we => io_we,
-			tx_byte => obyte,
+			tx_we => tx_we,
+			tx_byte => tx_byte,
 			tx_active => bsy,
 			tx_serial => tx,
 			tx_done => open);